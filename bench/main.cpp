@@ -0,0 +1,666 @@
+/*
+    SPDX-FileCopyrightText: 2026 Igor Mironchik <igor.mironchik@gmail.com>
+    SPDX-License-Identifier: MIT
+*/
+
+// qgiflib include.
+#include <qgiflib.hpp>
+
+// Qt include.
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImage>
+#include <QList>
+#include <QProcess>
+#include <QString>
+#include <QStringList>
+
+// C++ include.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+
+//! Image of the corpus.
+struct Sample {
+    QString name;
+    QImage image;
+};
+
+//! Quantizer mode under test.
+struct Mode {
+    QByteArray name;
+    QGifLib::QuantizeOptions options;
+};
+
+//! Accumulated result of the mode.
+struct Result {
+    qint64 pixels = 0;
+    qint64 nsecs = 0;
+    //! Sum of squared errors of components.
+    double squaredError = 0.0;
+    //! Sum of CIE76 color differences.
+    double deltaE = 0.0;
+    //! Count of compared pixels, fully transparent pixels are skipped.
+    qint64 compared = 0;
+}; // struct Result
+
+//! \return Peak resident memory of the process in bytes.
+quint64 peakMemory()
+{
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+
+    return 0;
+#else
+    rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(Q_OS_MACOS)
+        return static_cast<quint64>(usage.ru_maxrss);
+#else
+        return static_cast<quint64>(usage.ru_maxrss) * 1024;
+#endif
+    }
+
+    return 0;
+#endif
+}
+
+//
+// Lab
+//
+
+//! Conversion of sRGB to CIELAB with D65 white point.
+class Lab final
+{
+public:
+    Lab()
+    {
+        for (int i = 0; i < 256; ++i) {
+            const double c = i / 255.0;
+
+            m_linear[i] = (c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+        }
+    }
+
+    //! Convert \a color to \a lab.
+    void convert(QRgb color,
+                 double *lab) const
+    {
+        const double r = m_linear[qRed(color)];
+        const double g = m_linear[qGreen(color)];
+        const double b = m_linear[qBlue(color)];
+
+        const double x = f((0.4124564 * r + 0.3575761 * g + 0.1804375 * b) / 0.95047);
+        const double y = f(0.2126729 * r + 0.7151522 * g + 0.0721750 * b);
+        const double z = f((0.0193339 * r + 0.1191920 * g + 0.9503041 * b) / 1.08883);
+
+        lab[0] = 116.0 * y - 16.0;
+        lab[1] = 500.0 * (x - y);
+        lab[2] = 200.0 * (y - z);
+    }
+
+    //! \return CIE76 difference of two colors.
+    double deltaE(QRgb c1,
+                  QRgb c2) const
+    {
+        double l1[3];
+        double l2[3];
+        convert(c1, l1);
+        convert(c2, l2);
+
+        return std::sqrt((l1[0] - l2[0]) * (l1[0] - l2[0]) + (l1[1] - l2[1]) * (l1[1] - l2[1])
+                         + (l1[2] - l2[2]) * (l1[2] - l2[2]));
+    }
+
+private:
+    static double f(double t)
+    {
+        return (t > 216.0 / 24389.0 ? std::cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0);
+    }
+
+private:
+    double m_linear[256];
+}; // class Lab
+
+//! Compare quantized image with the source.
+void compare(const QImage &source,
+             const QImage &quantized,
+             const Lab &lab,
+             Result &result)
+{
+    const QImage src = source.convertToFormat(QImage::Format_ARGB32);
+    const QImage res = quantized.convertToFormat(QImage::Format_ARGB32);
+
+    QRgb lastSrc = 0;
+    QRgb lastRes = 0;
+    double lastDeltaE = 0.0;
+
+    for (int y = 0; y < src.height(); ++y) {
+        const auto *s = reinterpret_cast<const QRgb *>(src.constScanLine(y));
+        const auto *r = reinterpret_cast<const QRgb *>(res.constScanLine(y));
+
+        for (int x = 0; x < src.width(); ++x) {
+            if (qAlpha(s[x]) == 0) {
+                continue;
+            }
+
+            const int dr = qRed(s[x]) - qRed(r[x]);
+            const int dg = qGreen(s[x]) - qGreen(r[x]);
+            const int db = qBlue(s[x]) - qBlue(r[x]);
+
+            result.squaredError += dr * dr + dg * dg + db * db;
+
+            // Runs of equal colors are common, don't convert them again.
+            if (s[x] != lastSrc || r[x] != lastRes || result.compared == 0) {
+                lastSrc = s[x];
+                lastRes = r[x];
+                lastDeltaE = lab.deltaE(lastSrc, lastRes);
+            }
+
+            result.deltaE += lastDeltaE;
+            ++result.compared;
+        }
+    }
+}
+
+//
+// Corpus.
+//
+
+//! \return Deterministic pseudo-random number.
+quint32 nextRandom(quint32 &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+//! \return Photo-like frame, smooth gradients with soft blobs and sensor noise.
+QImage photoFrame(int width,
+                  int height)
+{
+    QImage img(width, height, QImage::Format_RGB32);
+    quint32 state = 0x9E3779B9u;
+
+    struct Blob {
+        double x;
+        double y;
+        double radius;
+        int red;
+        int green;
+        int blue;
+    };
+
+    std::vector<Blob> blobs;
+
+    for (int i = 0; i < 12; ++i) {
+        Blob blob;
+        blob.x = nextRandom(state) % width;
+        blob.y = nextRandom(state) % height;
+        blob.radius = width / 16.0 + nextRandom(state) % (width / 6);
+        blob.red = nextRandom(state) % 256;
+        blob.green = nextRandom(state) % 256;
+        blob.blue = nextRandom(state) % 256;
+
+        blobs.push_back(blob);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        auto *line = reinterpret_cast<QRgb *>(img.scanLine(y));
+
+        for (int x = 0; x < width; ++x) {
+            // Sky to ground gradient.
+            double r = 90.0 + 110.0 * y / height;
+            double g = 140.0 + 60.0 * y / height - 40.0 * x / width;
+            double b = 220.0 - 150.0 * y / height;
+
+            for (const auto &blob : blobs) {
+                const double dx = x - blob.x;
+                const double dy = y - blob.y;
+                const double w = std::exp(-(dx * dx + dy * dy) / (blob.radius * blob.radius));
+
+                r += (blob.red - r) * w;
+                g += (blob.green - g) * w;
+                b += (blob.blue - b) * w;
+            }
+
+            const int noise = static_cast<int>(nextRandom(state) % 9) - 4;
+
+            line[x] = qRgb(qBound(0, static_cast<int>(r) + noise, 255),
+                           qBound(0, static_cast<int>(g) + noise, 255),
+                           qBound(0, static_cast<int>(b) + noise, 255));
+        }
+    }
+
+    return img;
+}
+
+//! \return UI-like frame, flat panels, borders, gradient bars and antialiased text-like strokes.
+QImage uiFrame(int width,
+               int height)
+{
+    QImage img(width, height, QImage::Format_RGB32);
+    img.fill(qRgb(246, 246, 248));
+
+    quint32 state = 0x2545F491u;
+
+    const auto fillRect = [&img](int x, int y, int w, int h, QRgb color) {
+        for (int j = qMax(y, 0); j < qMin(y + h, img.height()); ++j) {
+            auto *line = reinterpret_cast<QRgb *>(img.scanLine(j));
+
+            for (int i = qMax(x, 0); i < qMin(x + w, img.width()); ++i) {
+                line[i] = color;
+            }
+        }
+    };
+
+    // Title bar with gradient.
+    for (int y = 0; y < 40; ++y) {
+        fillRect(0, y, width, 1, qRgb(40 + y, 60 + y, 110 + y * 2));
+    }
+
+    // Side panel.
+    fillRect(0, 40, 260, height - 40, qRgb(52, 56, 64));
+
+    for (int i = 0; i < 14; ++i) {
+        fillRect(16, 64 + i * 36, 228, 24, (i == 3 ? qRgb(70, 110, 200) : qRgb(62, 66, 76)));
+    }
+
+    // Cards with borders and text-like lines, edges of glyphs are antialiased.
+    for (int card = 0; card < 9; ++card) {
+        const int x = 290 + (card % 3) * ((width - 320) / 3);
+        const int y = 70 + (card / 3) * ((height - 100) / 3);
+        const int w = (width - 320) / 3 - 24;
+        const int h = (height - 100) / 3 - 24;
+
+        fillRect(x, y, w, h, qRgb(200, 202, 208));
+        fillRect(x + 1, y + 1, w - 2, h - 2, qRgb(255, 255, 255));
+        fillRect(x + 1, y + 1, w - 2, 6, qRgb(static_cast<int>(nextRandom(state) % 200), 120, 220));
+
+        for (int row = 0; row < 8 && 24 + row * 22 < h - 16; ++row) {
+            int cx = x + 16;
+            const int cy = y + 24 + row * 22;
+
+            while (cx < x + w - 24) {
+                const int glyph = 4 + static_cast<int>(nextRandom(state) % 9);
+
+                fillRect(cx, cy, glyph, 12, qRgb(30, 32, 36));
+                fillRect(cx - 1, cy, 1, 12, qRgb(150, 151, 154));
+                fillRect(cx + glyph, cy, 1, 12, qRgb(190, 191, 194));
+
+                cx += glyph + 2 + (nextRandom(state) % 6 == 0 ? 6 : 0);
+            }
+        }
+    }
+
+    return img;
+}
+
+//! \return Corpus of images: first frames of GIFs from \a picDir and generated frames.
+QList<Sample> corpus(const QString &picDir)
+{
+    QList<Sample> samples;
+
+    QDir dir(picDir);
+    const auto files = dir.entryList({QStringLiteral("*.gif")}, QDir::Files, QDir::Name);
+
+    for (const auto &file : files) {
+        QGifLib::Gif gif(QGifLib::FrameStorage::Lazy);
+
+        if (gif.load(dir.filePath(file)) && gif.count()) {
+            samples.push_back({file, gif.at(0)});
+        } else {
+            std::fprintf(stderr, "Can't load %s.\n", qPrintable(dir.filePath(file)));
+        }
+    }
+
+    samples.push_back({QStringLiteral("photo-640x480"), photoFrame(640, 480)});
+    // Larger than 4 megapixels, so automatic histogram stride samples it.
+    samples.push_back({QStringLiteral("photo-3840x2160"), photoFrame(3840, 2160)});
+    samples.push_back({QStringLiteral("ui-1920x1080"), uiFrame(1920, 1080)});
+
+    return samples;
+}
+
+//! Measure Gif::probe() on GIFs from \a picDir, time is the best of \a repeat.
+void probeThroughput(const QString &picDir,
+                     int repeat)
+{
+    QDir dir(picDir);
+    const auto files = dir.entryList({QStringLiteral("*.gif")}, QDir::Files, QDir::Name);
+    qint64 bytes = 0;
+    qint64 nsecs = 0;
+    qint64 frames = 0;
+
+    for (const auto &file : files) {
+        const QString fileName = dir.filePath(file);
+        QGifLib::GifInfo info;
+        qint64 best = std::numeric_limits<qint64>::max();
+
+        for (int r = 0; r < repeat; ++r) {
+            QElapsedTimer timer;
+            timer.start();
+
+            if (!QGifLib::Gif::probe(fileName, info)) {
+                std::fprintf(stderr, "Can't probe %s.\n", qPrintable(fileName));
+
+                break;
+            }
+
+            best = qMin(best, timer.nsecsElapsed());
+        }
+
+        if (info.count) {
+            bytes += QFileInfo(fileName).size();
+            nsecs += best;
+            frames += info.count;
+        }
+    }
+
+    std::printf("Probe: %lld files, %lld frames, %.2f MB, %.3f GB/s.\n\n",
+                static_cast<long long int>(files.size()),
+                static_cast<long long int>(frames),
+                bytes / (1024.0 * 1024.0),
+                (nsecs ? static_cast<double>(bytes) / nsecs : 0.0));
+}
+
+//! \return Quantizer modes under test.
+QList<Mode> modes(int threads)
+{
+    using namespace QGifLib;
+
+    const struct {
+        const char *name;
+        Quantizer quantizer;
+    } quantizers[] = {{"median-cut", Quantizer::MedianCut}, {"wu", Quantizer::Wu}, {"octree", Quantizer::Octree}};
+
+    const struct {
+        const char *name;
+        Dithering dithering;
+    } ditherings[] = {{"", Dithering::None},
+                      {"+bayer", Dithering::Bayer},
+                      {"+floyd-steinberg", Dithering::FloydSteinberg}};
+
+    QList<Mode> res;
+
+    const auto add = [&res](const QByteArray &name, QuantizeOptions options, int threads) {
+        options.maxThreads = threads;
+        res.push_back({name, options});
+    };
+
+    for (const auto &q : quantizers) {
+        for (const auto &d : ditherings) {
+            QuantizeOptions options;
+            options.quantizer = q.quantizer;
+            options.dithering = d.dithering;
+
+            add(QByteArray(q.name) + d.name, options, threads);
+        }
+    }
+
+    QuantizeOptions options;
+    options.colorSpace = ColorSpace::YCbCr;
+    add("median-cut+ycbcr", options, threads);
+
+    options.colorSpace = ColorSpace::Oklab;
+    add("median-cut+oklab", options, threads);
+
+    options = {};
+    options.kmeansIterations = 8;
+    add("median-cut+k-means", options, threads);
+
+    options = {};
+    options.histogramStride = 0;
+    add("median-cut+sampled", options, threads);
+
+    return res;
+}
+
+//! \return PSNR of the result in dB.
+double psnr(const Result &result)
+{
+    if (!result.compared) {
+        return 0.0;
+    }
+
+    const double mse = result.squaredError / (result.compared * 3.0);
+
+    return (mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity());
+}
+
+//! \return Megapixels per second.
+double throughput(const Result &result)
+{
+    return (result.nsecs ? result.pixels * 1000.0 / result.nsecs : 0.0);
+}
+
+//! Quantize the corpus with \a mode and print its row. Peak memory is the growth over \a baseline.
+//! \return PSNR of the mode.
+double benchMode(const Mode &mode,
+                 const QList<Sample> &samples,
+                 long long int colors,
+                 int repeat,
+                 bool verbose,
+                 quint64 baseline)
+{
+    const Lab lab;
+    QGifLib::QuantizerContext context;
+    Result total;
+
+    for (const auto &sample : samples) {
+        Result result;
+        QImage quantized;
+        qint64 best = std::numeric_limits<qint64>::max();
+
+        for (int r = 0; r < repeat; ++r) {
+            QElapsedTimer timer;
+            timer.start();
+
+            quantized = QGifLib::quantizeImageToKColors(sample.image, colors, mode.options, context);
+
+            best = qMin(best, timer.nsecsElapsed());
+        }
+
+        result.pixels = static_cast<qint64>(sample.image.width()) * sample.image.height();
+        result.nsecs = best;
+
+        compare(sample.image, quantized, lab, result);
+
+        if (verbose) {
+            std::printf("  %-32s %10.2f %10.2f %10.3f\n",
+                        qPrintable(sample.name),
+                        throughput(result),
+                        psnr(result),
+                        (result.compared ? result.deltaE / result.compared : 0.0));
+        }
+
+        total.pixels += result.pixels;
+        total.nsecs += result.nsecs;
+        total.squaredError += result.squaredError;
+        total.deltaE += result.deltaE;
+        total.compared += result.compared;
+    }
+
+    const quint64 peak = peakMemory();
+
+    std::printf("%-34s %10.2f %10.2f %10.3f %10.1f\n",
+                mode.name.constData(),
+                throughput(total),
+                psnr(total),
+                (total.compared ? total.deltaE / total.compared : 0.0),
+                (peak > baseline ? peak - baseline : 0) / (1024.0 * 1024.0));
+    std::fflush(stdout);
+
+    return psnr(total);
+}
+
+//! Run \a mode in a child process with \a args, so peak memory of other modes doesn't hide its own.
+//! Output of the child is printed. \return PSNR of the mode, 0 on error.
+double runMode(const QStringList &args,
+               const QByteArray &mode)
+{
+    QProcess process;
+    process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    process.start(QCoreApplication::applicationFilePath(),
+                  QStringList(args) << QStringLiteral("--mode") << QString::fromLatin1(mode)
+                                    << QStringLiteral("--child"));
+
+    if (!process.waitForFinished(-1) || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        std::fprintf(stderr, "Mode %s failed.\n", mode.constData());
+
+        return 0.0;
+    }
+
+    const QByteArray output = process.readAllStandardOutput();
+    std::fwrite(output.constData(), 1, static_cast<size_t>(output.size()), stdout);
+    std::fflush(stdout);
+
+    // The last line is the row of the mode, PSNR is its third column.
+    const auto columns = output.trimmed().split('\n').last().simplified().split(' ');
+
+    return (columns.size() > 2 ? columns.at(2).toDouble() : 0.0);
+}
+
+void printUsage(const char *app)
+{
+    std::printf(
+        "Usage: %s [--pic <dir>] [--colors <k>] [--repeat <n>] [--threads <n>] [--mode <name>] [--verbose]\n"
+        "\n"
+        "Quantizes every image of the corpus with every quantizer mode and reports\n"
+        "megapixels per second, peak memory, PSNR and mean CIE76 color difference.\n"
+        "Every mode runs in its own process, peak memory is its growth over memory\n"
+        "of the loaded corpus. Metadata probe of GIFs is measured in gigabytes per second.\n"
+        "Time is the best of the repeats.\n",
+        app);
+}
+
+} /* namespace anonymous */
+
+int main(int argc,
+         char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QString picDir = QStringLiteral(QGIFLIB_BENCH_PIC_DIR);
+    long long int colors = 256;
+    int repeat = 3;
+    int threads = 0;
+    QByteArray onlyMode;
+    bool verbose = false;
+    // Run by runMode(), only the row of the mode is printed.
+    bool child = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const bool hasValue = (i + 1 < argc);
+
+        if (!std::strcmp(argv[i], "--pic") && hasValue) {
+            picDir = QString::fromLocal8Bit(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--colors") && hasValue) {
+            colors = std::atoll(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--repeat") && hasValue) {
+            repeat = qMax(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "--threads") && hasValue) {
+            threads = qMax(0, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "--mode") && hasValue) {
+            onlyMode = argv[++i];
+        } else if (!std::strcmp(argv[i], "--verbose")) {
+            verbose = true;
+        } else if (!std::strcmp(argv[i], "--child")) {
+            child = true;
+        } else {
+            printUsage(argv[0]);
+
+            return (!std::strcmp(argv[i], "--help") ? 0 : 1);
+        }
+    }
+
+    if (!child) {
+        probeThroughput(picDir, repeat);
+    }
+
+    const auto samples = corpus(picDir);
+    const quint64 baseline = peakMemory();
+
+    if (!child) {
+        qint64 corpusPixels = 0;
+
+        for (const auto &s : samples) {
+            corpusPixels += static_cast<qint64>(s.image.width()) * s.image.height();
+        }
+
+        std::printf("Corpus: %lld images, %.2f megapixels, %lld colors, SIMD level %d.\n\n",
+                    static_cast<long long int>(samples.size()),
+                    corpusPixels / 1000000.0,
+                    colors,
+                    static_cast<int>(QGifLib::simdLevel()));
+        std::printf("%-34s %10s %10s %10s %10s\n", "mode", "MP/s", "PSNR dB", "mean dE", "peak MB");
+        std::fflush(stdout);
+    }
+
+    const auto all = modes(threads);
+
+    if (!onlyMode.isEmpty()) {
+        for (const auto &mode : all) {
+            if (mode.name == onlyMode) {
+                benchMode(mode, samples, colors, repeat, verbose, baseline);
+
+                return 0;
+            }
+        }
+
+        std::fprintf(stderr, "Unknown mode %s.\n", onlyMode.constData());
+
+        return 1;
+    }
+
+    QStringList args = {QStringLiteral("--pic"),
+                        picDir,
+                        QStringLiteral("--colors"),
+                        QString::number(colors),
+                        QStringLiteral("--repeat"),
+                        QString::number(repeat),
+                        QStringLiteral("--threads"),
+                        QString::number(threads)};
+
+    if (verbose) {
+        args << QStringLiteral("--verbose");
+    }
+
+    double fullPsnr = 0.0;
+
+    for (const auto &mode : all) {
+        const double modePsnr = runMode(args, mode.name);
+
+        if (mode.name == "median-cut") {
+            fullPsnr = modePsnr;
+        } else if (mode.name == "median-cut+sampled" && fullPsnr > 0.0 && modePsnr > 0.0) {
+            std::printf("%-34s %10s %+10.2f\n", "  sampling PSNR delta", "", modePsnr - fullPsnr);
+        }
+    }
+
+    return 0;
+}
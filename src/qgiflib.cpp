@@ -1,4 +1,3 @@
-
 /*
     SPDX-FileCopyrightText: 2026 Igor Mironchik <igor.mironchik@gmail.com>
     SPDX-License-Identifier: MIT
@@ -12,13 +11,43 @@
 #include "qgiflib.hpp"
 
 // C++ include.
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <thread>
 #include <utility>
 #include <vector>
 
 // Qt include.
+#include <QFile>
+#include <QImageReader>
+#include <QMutex>
 #include <QPainter>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtAlgorithms>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define QGIFLIB_X86_SIMD
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+
+#define QGIFLIB_TARGET_SSE41
+#define QGIFLIB_TARGET_AVX2
+#else
+#define QGIFLIB_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define QGIFLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 namespace QGifLib
 {
@@ -26,741 +55,4966 @@ namespace QGifLib
 namespace /* anonymous */
 {
 
-struct Color {
-    unsigned char red = 0;
-    unsigned char green = 0;
-    unsigned char blue = 0;
-
-    bool operator==(const Color &c) const;
-
-    bool operator<(const Color &c) const;
-};
-
-size_t qHash(const Color &c)
+//! Packed color, 0x00RRGGBB.
+inline quint32 packedColor(QRgb c)
 {
-    return (c.red << 16 | c.green << 8 | c.blue);
+    return c & 0x00FFFFFFu;
 }
 
-bool Color::operator==(const Color &c) const
+inline unsigned char redOf(quint32 c)
 {
-    return qHash(*this) == qHash(c);
+    return static_cast<unsigned char>(c >> 16);
 }
 
-bool Color::operator<(const Color &c) const
+inline unsigned char greenOf(quint32 c)
 {
-    return qHash(*this) < qHash(c);
+    return static_cast<unsigned char>(c >> 8);
 }
 
-enum ColorComponent {
-    Red,
-    Green,
-    Blue
-};
+inline unsigned char blueOf(quint32 c)
+{
+    return static_cast<unsigned char>(c);
+}
 
-struct ColorRange {
-    unsigned char lowest = 0;
-    unsigned char highest = 0;
-};
+//
+// ColorHash
+//
 
-QPair<ColorComponent,
-      ColorRange>
-longestSide(const QMap<Color,
-                       long long int> &s)
+//! Open addressing hash table with packed colors as keys and linear probing.
+template<typename T>
+class ColorHash
 {
-    ColorRange red = {s.firstKey().red, 0};
-    ColorRange green = {s.firstKey().green, 0};
-    ColorRange blue = {s.firstKey().blue, 0};
+public:
+    //! Marker of the empty slot, never equal to a packed color.
+    static constexpr quint32 s_empty = 0xFFFFFFFFu;
 
-    for (auto it = s.constBegin(), last = s.constEnd(); it != last; ++it) {
-        if (it.key().red < red.lowest) {
-            red.lowest = it.key().red;
-        }
+    //! Clear table and prepare it for the given count of distinct colors. Memory is reused.
+    void reset(qsizetype expected)
+    {
+        qsizetype capacity = 1024;
 
-        if (it.key().red > red.highest) {
-            red.highest = it.key().red;
+        while (capacity < expected * 2) {
+            capacity <<= 1;
         }
 
-        if (it.key().green < green.lowest) {
-            green.lowest = it.key().green;
-        }
+        m_keys.assign(capacity, s_empty);
+        m_values.assign(capacity, T());
+        m_size = 0;
+        m_mask = static_cast<quint32>(capacity - 1);
+    }
+
+    //! \return Value of the color, inserts default value if there is no such color.
+    T &value(quint32 color)
+    {
+        quint32 i = slot(color);
+
+        while (m_keys[i] != color) {
+            if (m_keys[i] == s_empty) {
+                m_keys[i] = color;
+                ++m_size;
 
-        if (it.key().green > green.highest) {
-            green.highest = it.key().green;
+                if (m_size * 2 > static_cast<qsizetype>(m_keys.size())) {
+                    grow();
+                    i = slot(color);
+
+                    while (m_keys[i] != color) {
+                        i = (i + 1) & m_mask;
+                    }
+                }
+
+                break;
+            }
+
+            i = (i + 1) & m_mask;
         }
 
-        if (it.key().blue < blue.lowest) {
-            blue.lowest = it.key().blue;
+        return m_values[i];
+    }
+
+    //! \return Value of the color or nullptr if the color is not in the table.
+    const T *find(quint32 color) const
+    {
+        quint32 i = slot(color);
+
+        while (m_keys[i] != color) {
+            if (m_keys[i] == s_empty) {
+                return nullptr;
+            }
+
+            i = (i + 1) & m_mask;
         }
 
-        if (it.key().blue > blue.highest) {
-            blue.highest = it.key().blue;
+        return &m_values[i];
+    }
+
+    //! \return Count of distinct colors.
+    qsizetype size() const
+    {
+        return m_size;
+    }
+
+    //! \return Raw keys, empty slots are marked with s_empty.
+    const std::vector<quint32> &keys() const
+    {
+        return m_keys;
+    }
+
+    //! \return Raw values.
+    const std::vector<T> &values() const
+    {
+        return m_values;
+    }
+
+private:
+    quint32 slot(quint32 color) const
+    {
+        return ((color * 2654435761u) >> 8) & m_mask;
+    }
+
+    //! Double the table, the old one is kept for the next growth.
+    void grow()
+    {
+        std::swap(m_oldKeys, m_keys);
+        std::swap(m_oldValues, m_values);
+
+        m_keys.assign(m_oldKeys.size() * 2, s_empty);
+        m_values.assign(m_oldValues.size() * 2, T());
+
+        m_mask = static_cast<quint32>(m_keys.size() - 1);
+
+        for (size_t j = 0; j < m_oldKeys.size(); ++j) {
+            if (m_oldKeys[j] != s_empty) {
+                quint32 i = slot(m_oldKeys[j]);
+
+                while (m_keys[i] != s_empty) {
+                    i = (i + 1) & m_mask;
+                }
+
+                m_keys[i] = m_oldKeys[j];
+                m_values[i] = m_oldValues[j];
+            }
         }
     }
 
-    unsigned char redDistance = qRound((float)(red.highest - red.lowest) * 0.299f);
-    unsigned char greenDistance = qRound((float)(green.highest - green.lowest) * 0.587f);
-    unsigned char blueDistance = qRound((float)(blue.highest - blue.lowest) * 0.114f);
+private:
+    std::vector<quint32> m_keys;
+    std::vector<T> m_values;
+    std::vector<quint32> m_oldKeys;
+    std::vector<T> m_oldValues;
+    qsizetype m_size = 0;
+    quint32 m_mask = 0;
+}; // class ColorHash
 
-    const QMap<unsigned char, ColorComponent> m = {{redDistance, Red}, {greenDistance, Green}, {blueDistance, Blue}};
+//! Minimum count of pixels processed by one thread.
+const qsizetype s_minPixelsPerStripe = 1 << 16;
 
-    switch (m.last()) {
-    case Red:
-        return {Red, red};
+//! Count of pixels of each color.
+using ColorHistogram = ColorHash<quint32>;
 
-    case Green:
-        return {Green, green};
+//! Index in the palette of each color.
+using InverseColorMap = ColorHash<unsigned char>;
 
-    case Blue:
-        return {Blue, blue};
+//! Key of fully transparent pixels in the histogram, it's not a packed color.
+constexpr quint32 s_transparentKey = 0xFF000000u;
 
-    default:
-        return {Red, red};
+//! \return Key of the pixel in the histogram, fully transparent pixels share one key if \a Alpha.
+template<bool Alpha>
+inline quint32 keyOf(QRgb color)
+{
+    return (Alpha && qAlpha(color) == 0 ? s_transparentKey : packedColor(color));
+}
+
+//
+// Parallel execution.
+//
+
+//! Part of the work executed on the thread pool.
+class StripeTask final : public QRunnable
+{
+public:
+    StripeTask()
+    {
+        setAutoDelete(false);
     }
+
+    //! Call \a call(func, stripe) on run and release \a done.
+    void set(void (*call)(const void *,
+                          int),
+             const void *func,
+             int stripe,
+             QSemaphore *done)
+    {
+        m_call = call;
+        m_func = func;
+        m_stripe = stripe;
+        m_done = done;
+    }
+
+    void run() override
+    {
+        m_call(m_func, m_stripe);
+        m_done->release();
+    }
+
+private:
+    void (*m_call)(const void *,
+                   int) = nullptr;
+    const void *m_func = nullptr;
+    int m_stripe = 0;
+    QSemaphore *m_done = nullptr;
+}; // class StripeTask
+
+//! Tasks of parallelFor(), they are reused between calls.
+struct ParallelTasks {
+    std::unique_ptr<StripeTask[]> tasks;
+    int size = 0;
+    //! Released by every finished task.
+    QSemaphore done;
+
+    //! Grow the array to at least \a count tasks.
+    void reserve(int count)
+    {
+        if (size < count) {
+            tasks.reset(new StripeTask[count]);
+            size = count;
+        }
+    }
+};
+
+//! \return Count of stripes for \a count items with at least \a minPerStripe items in a stripe.
+int stripesCount(qsizetype count,
+                 qsizetype minPerStripe,
+                 const QuantizeOptions &options)
+{
+    auto *pool = (options.threadPool ? options.threadPool : QThreadPool::globalInstance());
+    const int threads = (options.maxThreads > 0 ? options.maxThreads : pool->maxThreadCount());
+
+    return static_cast<int>(qBound(static_cast<qsizetype>(1), count / qMax(minPerStripe, static_cast<qsizetype>(1)),
+                                   static_cast<qsizetype>(qMax(threads, 1))));
 }
 
-void splitByLongestSide(const QMap<Color,
-                                   long long int> &s,
-                        QVector<QMap<Color,
-                                     long long int>> &appendTo)
+//! Call \a func(stripe, begin, end) for \a stripes parts of [0, count) in parallel.
+//! The calling thread takes part in the work, so it's safe to call it from the thread pool.
+//! \a tasks only grow, so memory is allocated only when count of stripes grows.
+template<typename Func>
+void parallelFor(qsizetype count,
+                 int stripes,
+                 const QuantizeOptions &options,
+                 ParallelTasks &tasks,
+                 const Func &func)
 {
-    QMap<Color, long long int> left, right;
+    if (stripes <= 1) {
+        func(0, 0, count);
 
-    if (!s.isEmpty()) {
-        const auto side = longestSide(s);
-        const unsigned char middle = (side.second.highest - side.second.lowest) / 2 + side.second.lowest;
+        return;
+    }
 
-        for (auto it = s.cbegin(), last = s.cend(); it != last; ++it) {
-            switch (side.first) {
-            case Red: {
-                if (it.key().red < middle)
-                    left.insert(it.key(), it.value());
-                else
-                    right.insert(it.key(), it.value());
-            } break;
+    struct Work {
+        const Func &func;
+        qsizetype count;
+        int stripes;
 
-            case Green: {
-                if (it.key().green < middle)
-                    left.insert(it.key(), it.value());
-                else
-                    right.insert(it.key(), it.value());
-            } break;
+        qsizetype begin(int stripe) const
+        {
+            return count * stripe / stripes;
+        }
+    };
 
-            case Blue: {
-                if (it.key().blue < middle)
-                    left.insert(it.key(), it.value());
-                else
-                    right.insert(it.key(), it.value());
-            } break;
+    const Work work = {func, count, stripes};
+    const auto call = [](const void *w, int stripe) {
+        const auto &work = *static_cast<const Work *>(w);
 
-            default:
-                break;
-            }
+        work.func(stripe, work.begin(stripe), work.begin(stripe + 1));
+    };
+
+    auto *pool = (options.threadPool ? options.threadPool : QThreadPool::globalInstance());
+    tasks.reserve(stripes - 1);
+
+    for (int i = 1; i < stripes; ++i) {
+        tasks.tasks[i - 1].set(call, &work, i, &tasks.done);
+
+        pool->start(&tasks.tasks[i - 1]);
+    }
+
+    call(&work, 0);
+
+    // Not started tasks are done here, the pool may be busy with our callers.
+    for (int i = 0; i < stripes - 1; ++i) {
+        if (pool->tryTake(&tasks.tasks[i])) {
+            tasks.tasks[i].run();
         }
     }
 
-    appendTo.push_back(left);
-    appendTo.push_back(right);
+    tasks.done.acquire(stripes - 1);
 }
 
-QRgb colorForSet(const QMap<Color,
-                            long long int> &s)
+//! Collect colors of rows [first, last) of the 32-bit image into the histogram.
+template<bool Alpha>
+void collectColors(const QImage &img,
+                   qsizetype first,
+                   qsizetype last,
+                   ColorHistogram &histogram)
 {
-    long long int red = 0, green = 0, blue = 0;
-    long long int count = 0;
+    for (qsizetype y = first; y < last; ++y) {
+        const auto *line = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+
+        // Count runs of the same color, screen captures are full of them.
+        quint32 color = keyOf<Alpha>(line[0]);
+        quint32 count = 0;
 
-    if (!s.isEmpty()) {
-        for (auto it = s.cbegin(), last = s.cend(); it != last; ++it) {
-            red += it.key().red * it.value();
-            green += it.key().green * it.value();
-            blue += it.key().blue * it.value();
-            count += it.value();
+        for (int x = 0; x < img.width(); ++x) {
+            const quint32 c = keyOf<Alpha>(line[x]);
+
+            if (c == color) {
+                ++count;
+            } else {
+                histogram.value(color) += count;
+                color = c;
+                count = 1;
+            }
         }
 
-        return qRgb(red / count, green / count, blue / count);
-    } else {
-        return qRgb(0, 0, 0);
+        histogram.value(color) += count;
     }
 }
 
-uint indexOfColor(const QColor &c,
-                  const QVector<QMap<Color,
-                                     long long int>> &indexed)
+//! Collect every \a stride-th pixel of every \a stride-th row from [first, last) into the histogram.
+//! Sampled columns are shifted from row to row, that avoids aliasing with regular patterns.
+template<bool Alpha>
+void sampleColors(const QImage &img,
+                  qsizetype first,
+                  qsizetype last,
+                  int stride,
+                  ColorHistogram &histogram)
 {
-    uint i = 0;
-    const auto cc = Color{static_cast<unsigned char>(c.red()),
-                          static_cast<unsigned char>(c.green()),
-                          static_cast<unsigned char>(c.blue())};
+    for (qsizetype y = first + (stride - first % stride) % stride; y < last; y += stride) {
+        const auto *line = reinterpret_cast<const QRgb *>(img.constScanLine(y));
 
-    for (; i < indexed.size(); ++i) {
-        if (indexed[i].contains(cc)) {
-            return i;
+        for (int x = static_cast<int>(((static_cast<quint32>(y) * 2654435761u) >> 16) % stride); x < img.width();
+             x += stride) {
+            ++histogram.value(keyOf<Alpha>(line[x]));
         }
     }
-
-    return 0;
 }
 
-} /* namespace anonymous */
+//! Images larger than this are sampled in automatic mode.
+const qsizetype s_autoSamplingPixels = 4 * 1024 * 1024;
+//! Count of samples in automatic mode.
+const qsizetype s_autoSamples = 1024 * 1024;
 
-QImage quantizeImageToKColors(const QImage &img,
-                              long long int k)
+//! \return Stride of sampling of the histogram.
+int histogramStride(const QImage &img,
+                    const QuantizeOptions &options)
 {
-    if (k == 0 || k == 1) {
-        return QImage();
+    if (options.histogramStride > 0) {
+        return options.histogramStride;
     }
 
-    long long int n = 1;
+    const auto pixels = static_cast<qsizetype>(img.width()) * img.height();
 
-    while (n < k) {
-        n <<= 1;
+    if (pixels <= s_autoSamplingPixels) {
+        return 1;
     }
 
-    k = n;
+    int stride = 2;
 
-    QVector<QMap<Color, long long int>> indexed;
-    indexed.push_back({});
-
-    // collect colors and count them
-    for (long long int y = 0; y < img.height(); ++y) {
-        for (long long int x = 0; x < img.width(); ++x) {
-            const auto ic = img.pixelColor(x, y);
-            const auto c = Color{static_cast<unsigned char>(ic.red()),
-                                 static_cast<unsigned char>(ic.green()),
-                                 static_cast<unsigned char>(ic.blue())};
-
-            if (!indexed.front().contains(c)) {
-                indexed.front()[c] = 1;
-            } else {
-                ++indexed.front()[c];
-            }
-        }
+    while (pixels / (static_cast<qsizetype>(stride) * stride) > s_autoSamples) {
+        ++stride;
     }
 
-    // split by colors cube.
-    while (n != 1) {
-        QVector<QMap<Color, long long int>> tmp;
+    return stride;
+}
 
-        for (const auto &s : std::as_const(indexed)) {
-            splitByLongestSide(s, tmp);
-        }
+//! Collect colors of the Indexed8 image into the histogram, pixels are counted by indices.
+void collectIndexedColors(const QImage &img,
+                          ColorHistogram &histogram)
+{
+    quint32 counts[256] = {};
 
-        std::swap(indexed, tmp);
+    for (int y = 0; y < img.height(); ++y) {
+        const uchar *line = img.constScanLine(y);
 
-        n /= 2;
+        for (int x = 0; x < img.width(); ++x) {
+            ++counts[line[x]];
+        }
     }
 
-    // Separate most common colors if we have empty slots.
-    QVector<qsizetype> emptyIdx;
+    const auto table = img.colorTable();
 
-    for (auto i = 0; i < k; ++i) {
-        if (indexed[i].empty()) {
-            emptyIdx.push_back(i);
+    histogram.reset(table.size());
+
+    for (qsizetype i = 0; i < table.size(); ++i) {
+        if (counts[i]) {
+            histogram.value(keyOf<true>(table[i])) += counts[i];
         }
     }
+}
 
-    if (!emptyIdx.empty()) {
-        std::multimap<long long int, std::pair<Color, QMap<Color, long long int> *>> colorsCount;
+//! Collect colors of the 32-bit or Indexed8 image into the histogram,
+//! stripes of the 32-bit image are counted in parallel into \a partial histograms. Fully transparent
+//! pixels of ARGB32 image or colors of the table are counted with s_transparentKey.
+void collectColors(const QImage &img,
+                   ColorHistogram &histogram,
+                   std::vector<ColorHistogram> &partial,
+                   ParallelTasks &tasks,
+                   const QuantizeOptions &options)
+{
+    if (img.format() == QImage::Format_Indexed8) {
+        collectIndexedColors(img, histogram);
 
-        for (auto i = 0; i < k; ++i) {
-            const auto keys = indexed[i].keys();
+        return;
+    }
+
+    const int stride = histogramStride(img, options);
+    const auto pixels = static_cast<qsizetype>(img.width()) * img.height() / (static_cast<qsizetype>(stride) * stride);
+    const int stripes = stripesCount(img.height(), s_minPixelsPerStripe / qMax(img.width(), 1) * stride * stride, options);
 
-            for (const auto &key : keys) {
-                colorsCount.insert(std::make_pair(indexed[i][key], std::make_pair(key, &indexed[i])));
+    const bool alpha = (img.format() == QImage::Format_ARGB32);
+
+    const auto collect = [&img, stride, alpha](qsizetype first, qsizetype last, ColorHistogram &h) {
+        if (stride == 1) {
+            if (alpha) {
+                collectColors<true>(img, first, last, h);
+            } else {
+                collectColors<false>(img, first, last, h);
             }
+        } else if (alpha) {
+            sampleColors<true>(img, first, last, stride, h);
+        } else {
+            sampleColors<false>(img, first, last, stride, h);
         }
+    };
 
-        for (auto it = colorsCount.crbegin(), last = colorsCount.crend(); it != last; ++it) {
-            if (it->second.second->size() > 1) {
-                indexed[emptyIdx.front()].insert(it->second.first, it->first);
+    histogram.reset(qMin(pixels, static_cast<qsizetype>(1) << 16));
 
-                it->second.second->remove(it->second.first);
+    if (stripes == 1) {
+        collect(0, img.height(), histogram);
 
-                emptyIdx.pop_front();
-            }
+        return;
+    }
 
-            if (emptyIdx.empty()) {
-                break;
+    if (static_cast<int>(partial.size()) < stripes) {
+        partial.resize(stripes);
+    }
+
+    parallelFor(img.height(), stripes, options, tasks, [&](int stripe, qsizetype first, qsizetype last) {
+        partial[stripe].reset(qMin(pixels / stripes, static_cast<qsizetype>(1) << 16));
+        collect(first, last, partial[stripe]);
+    });
+
+    for (int stripe = 0; stripe < stripes; ++stripe) {
+        const auto &p = partial[stripe];
+
+        for (size_t i = 0; i < p.keys().size(); ++i) {
+            if (p.keys()[i] != ColorHistogram::s_empty) {
+                histogram.value(p.keys()[i]) += p.values()[i];
             }
         }
     }
+}
+
+//! Color with count of pixels of this color.
+struct ColorBucket {
+    quint32 color = 0;
+    quint32 count = 0;
+};
+
+static_assert(sizeof(ColorBucket) == 8, "SIMD kernels expect ColorBucket to be 8 bytes.");
+
+//! Range [begin, end) of buckets that forms one color of the palette.
+struct ColorBox {
+    qsizetype begin = 0;
+    qsizetype end = 0;
 
-    QList<QRgb> newColors;
+    qsizetype size() const
+    {
+        return end - begin;
+    }
 
-    for (const auto &s : std::as_const(indexed)) {
-        newColors.push_back(colorForSet(s));
+    bool isEmpty() const
+    {
+        return begin == end;
     }
+};
 
-    QImage res(img.size(), QImage::Format_Indexed8);
-    res.setColorCount(k);
-    res.setColorTable(newColors);
+enum ColorComponent {
+    Red,
+    Green,
+    Blue
+};
+
+struct ColorRange {
+    unsigned char lowest = 0;
+    unsigned char highest = 0;
+};
+
+//! Bounding box of colors.
+struct ColorBounds {
+    ColorRange red = {255, 0};
+    ColorRange green = {255, 0};
+    ColorRange blue = {255, 0};
+};
+
+//! Sums of color components weighted by count of pixels.
+struct ColorSums {
+    quint64 red = 0;
+    quint64 green = 0;
+    quint64 blue = 0;
+    quint64 count = 0;
+};
+
+//! Palette in the layout suitable for the nearest color search.
+struct PaletteTable {
+    static constexpr int s_maxSize = 256;
+    //! Value of padding entries, far enough from any color.
+    static constexpr qint32 s_far = 4096;
+
+    alignas(32) qint32 red[s_maxSize];
+    alignas(32) qint32 green[s_maxSize];
+    alignas(32) qint32 blue[s_maxSize];
+    //! Count of colors.
+    int size = 0;
+    //! Count of colors rounded up to 8.
+    int paddedSize = 0;
+
+    void set(const QList<QRgb> &colors)
+    {
+        size = static_cast<int>(qMin(colors.size(), static_cast<qsizetype>(s_maxSize)));
+        paddedSize = (size + 7) / 8 * 8;
 
-    for (long long int y = 0; y < img.height(); ++y) {
-        for (long long int x = 0; x < img.width(); ++x) {
-            res.setPixel(x, y, indexOfColor(img.pixelColor(x, y), indexed));
+        for (int i = 0; i < paddedSize; ++i) {
+            red[i] = (i < size ? qRed(colors[i]) : s_far);
+            green[i] = (i < size ? qGreen(colors[i]) : s_far);
+            blue[i] = (i < size ? qBlue(colors[i]) : s_far);
         }
     }
-
-    return res;
-}
+};
 
 //
-// Gif
+// Scalar kernels.
 //
 
-Gif::Gif(const QString &tmpPath,
-         QObject *parent)
-    : QObject(parent)
-    , m_tmpPath(tmpPath)
-    , m_dir(tmpPath)
+void boundsScalar(const ColorBucket *buckets,
+                  qsizetype count,
+                  ColorBounds &b)
 {
+    for (qsizetype i = 0; i < count; ++i) {
+        const auto r = redOf(buckets[i].color);
+        const auto g = greenOf(buckets[i].color);
+        const auto bl = blueOf(buckets[i].color);
+
+        b.red.lowest = qMin(b.red.lowest, r);
+        b.red.highest = qMax(b.red.highest, r);
+        b.green.lowest = qMin(b.green.lowest, g);
+        b.green.highest = qMax(b.green.highest, g);
+        b.blue.lowest = qMin(b.blue.lowest, bl);
+        b.blue.highest = qMax(b.blue.highest, bl);
+    }
 }
 
-bool Gif::closeHandle(GifFileType *handle)
+//! Move buckets with component (color >> shift) less than middle to the beginning.
+//! \return Count of such buckets.
+qsizetype partitionScalar(ColorBucket *buckets,
+                          qsizetype count,
+                          int shift,
+                          unsigned char middle,
+                          ColorBucket *)
 {
-    if (!DGifCloseFile(handle, nullptr)) {
-        clean();
+    return std::partition(buckets,
+                          buckets + count,
+                          [middle, shift](const ColorBucket &b) {
+                              return static_cast<unsigned char>(b.color >> shift) < middle;
+                          })
+        - buckets;
+}
 
-        return false;
-    } else {
-        return true;
+void sumsScalar(const ColorBucket *buckets,
+                qsizetype count,
+                ColorSums &s)
+{
+    for (qsizetype i = 0; i < count; ++i) {
+        s.red += redOf(buckets[i].color) * (quint64)buckets[i].count;
+        s.green += greenOf(buckets[i].color) * (quint64)buckets[i].count;
+        s.blue += blueOf(buckets[i].color) * (quint64)buckets[i].count;
+        s.count += buckets[i].count;
     }
 }
 
-bool Gif::closeHandleWithError(GifFileType *handle)
+//! \return Index of the nearest color in the palette, the first one on equal distances.
+int nearestScalar(const PaletteTable &palette,
+                  quint32 color)
 {
-    closeHandle(handle);
-
-    clean();
+    const qint32 r = redOf(color);
+    const qint32 g = greenOf(color);
+    const qint32 b = blueOf(color);
+
+    int best = 0;
+    qint32 bestDistance = std::numeric_limits<qint32>::max();
+
+    for (int i = 0; i < palette.size; ++i) {
+        const qint32 dr = palette.red[i] - r;
+        const qint32 dg = palette.green[i] - g;
+        const qint32 db = palette.blue[i] - b;
+        const qint32 d = dr * dr + dg * dg + db * db;
+
+        if (d < bestDistance) {
+            bestDistance = d;
+            best = i;
+        }
+    }
 
-    return false;
+    return best;
 }
 
-bool Gif::closeEHandle(GifFileType *handle)
+//
+// Nearest color search.
+//
+
+//! Grid of candidates of the nearest color. Colors cube is divided into 16x16x16 cells, every cell
+//! has a list of colors of the palette that can be the nearest to some point of the cell, that is
+//! colors not farther from the cell than the farthest point of the cell from any color.
+//! Lists are built on first use, it's thread-safe, and take memory only for their colors. Cells with
+//! long lists are searched in the whole palette. Result is the same as of the search in the whole palette.
+class NearestColorGrid
 {
-    if (!EGifCloseFile(handle, nullptr)) {
-        return false;
-    } else {
-        return true;
+public:
+    //! Count of cells on a side of the cube.
+    static constexpr int s_side = 16;
+    static constexpr int s_cells = s_side * s_side * s_side;
+    //! Maximum length of the list.
+    static constexpr int s_maxCandidates = 64;
+
+    //! Forget lists, it's needed after change of the palette. Cells are allocated on the first call,
+    //! memory of lists is reused.
+    void reset()
+    {
+        if (!m_cells) {
+            m_cells = std::make_unique<Cell[]>(s_cells);
+        }
+
+        for (int i = 0; i < s_cells; ++i) {
+            m_cells[i].state.store(Empty, std::memory_order_relaxed);
+        }
+    }
+
+    //! \return Index of the nearest color, the first one on equal distances.
+    int nearest(const PaletteTable &palette,
+                quint32 color,
+                int (*search)(const PaletteTable &,
+                              quint32)) const
+    {
+        if (!m_cells) {
+            return search(palette, color);
+        }
+
+        const int cell = (redOf(color) >> 4) * s_side * s_side + (greenOf(color) >> 4) * s_side + (blueOf(color) >> 4);
+        uchar state = m_cells[cell].state.load(std::memory_order_acquire);
+
+        if (state == Empty) {
+            state = build(palette, cell);
+        }
+
+        if (state != Ready) {
+            return search(palette, color);
+        }
+
+        const qint32 r = redOf(color);
+        const qint32 g = greenOf(color);
+        const qint32 b = blueOf(color);
+        const Candidate *candidates = m_cells[cell].candidates.get();
+        const int count = m_cells[cell].count;
+
+        // Distance and index in one key, the least key is the first nearest color.
+        quint32 best = std::numeric_limits<quint32>::max();
+
+        // Candidates are ordered by distance to the cell, it's not greater than distance to the color.
+        for (int i = 0; i < count && candidates[i].key <= best; ++i) {
+            const qint32 dr = candidates[i].red - r;
+            const qint32 dg = candidates[i].green - g;
+            const qint32 db = candidates[i].blue - b;
+
+            best = qMin(best, (static_cast<quint32>(dr * dr + dg * dg + db * db) << 8) | candidates[i].index);
+        }
+
+        return static_cast<int>(best & 0xFF);
+    }
+
+private:
+    //! Color of the palette and its distance to the cell.
+    struct Candidate {
+        //! Distance to the cell shifted by 8 bits.
+        quint32 key;
+        uchar red;
+        uchar green;
+        uchar blue;
+        uchar index;
+    };
+
+    enum State : uchar {
+        Empty,
+        //! Another thread builds the list.
+        Building,
+        Ready,
+        //! List is too long, the whole palette is searched.
+        Whole
+    };
+
+    struct Cell {
+        std::atomic<uchar> state = {Empty};
+        uchar count = 0;
+        //! Size of allocated list.
+        uchar capacity = 0;
+        std::unique_ptr<Candidate[]> candidates;
+    };
+
+    //! Build list of the cell. \return State of the cell.
+    uchar build(const PaletteTable &palette,
+                int cell) const
+    {
+        auto &entry = m_cells[cell];
+        uchar expected = Empty;
+
+        if (!entry.state.compare_exchange_strong(expected, Building, std::memory_order_acq_rel)) {
+            return expected;
+        }
+
+        const qint32 low[3] = {(cell / (s_side * s_side)) * 16, (cell / s_side % s_side) * 16, (cell % s_side) * 16};
+        const qint32 *components[3] = {palette.red, palette.green, palette.blue};
+
+        // The least of the farthest distances from colors to points of the cell.
+        qint32 bound = std::numeric_limits<qint32>::max();
+
+        for (int i = 0; i < palette.size; ++i) {
+            qint32 farthest = 0;
+
+            for (int c = 0; c < 3; ++c) {
+                const qint32 d = qMax(qAbs(components[c][i] - low[c]), qAbs(components[c][i] - low[c] - 15));
+                farthest += d * d;
+            }
+
+            bound = qMin(bound, farthest);
+        }
+
+        Candidate candidates[s_maxCandidates];
+        int count = 0;
+
+        for (int i = 0; i < palette.size; ++i) {
+            qint32 closest = 0;
+
+            for (int c = 0; c < 3; ++c) {
+                const qint32 v = components[c][i];
+                const qint32 d = (v < low[c] ? low[c] - v : (v > low[c] + 15 ? v - low[c] - 15 : 0));
+                closest += d * d;
+            }
+
+            if (closest <= bound) {
+                if (count == s_maxCandidates) {
+                    entry.state.store(Whole, std::memory_order_release);
+
+                    return Whole;
+                }
+
+                candidates[count++] = {static_cast<quint32>(closest) << 8,
+                                       static_cast<uchar>(palette.red[i]),
+                                       static_cast<uchar>(palette.green[i]),
+                                       static_cast<uchar>(palette.blue[i]),
+                                       static_cast<uchar>(i)};
+            }
+        }
+
+        std::sort(candidates, candidates + count, [](const Candidate &l, const Candidate &r) {
+            return (l.key < r.key || (l.key == r.key && l.index < r.index));
+        });
+
+        // The cell is built only by this thread, so its list is allocated here.
+        if (entry.capacity < count) {
+            entry.candidates = std::make_unique<Candidate[]>(count);
+            entry.capacity = static_cast<uchar>(count);
+        }
+
+        std::copy(candidates, candidates + count, entry.candidates.get());
+        entry.count = static_cast<uchar>(count);
+        entry.state.store(Ready, std::memory_order_release);
+
+        return Ready;
     }
+
+private:
+    std::unique_ptr<Cell[]> m_cells;
+}; // class NearestColorGrid
+
+//! Direct mapped cache of results of the nearest color search.
+struct NearestCache {
+    static constexpr int s_bits = 12;
+
+    quint32 colors[1 << s_bits];
+    uchar indices[1 << s_bits];
+
+    //! Forget results, it's needed after change of the palette.
+    void reset()
+    {
+        std::fill(std::begin(colors), std::end(colors), InverseColorMap::s_empty);
+    }
+
+    static int slot(quint32 color)
+    {
+        return static_cast<int>((color * 2654435761u) >> (32 - s_bits));
+    }
+};
+
+//! Search of colors in the palette: colors of the inverse map, then the cache,
+//! then the nearest color with the grid.
+struct NearestSearch {
+    const InverseColorMap &inverse;
+    const PaletteTable &table;
+    const NearestColorGrid &grid;
+    //! Cache, can be nullptr.
+    NearestCache *cache;
+    //! Search in the whole palette.
+    int (*nearest)(const PaletteTable &,
+                   quint32);
+};
+
+//! \return Index of the color in the palette.
+inline uchar lookupIndex(quint32 color,
+                         NearestSearch &search)
+{
+    if (const auto *i = search.inverse.find(color)) {
+        return *i;
+    }
+
+    if (search.cache) {
+        const int slot = NearestCache::slot(color);
+
+        if (search.cache->colors[slot] != color) {
+            search.cache->colors[slot] = color;
+            search.cache->indices[slot] =
+                static_cast<uchar>(search.grid.nearest(search.table, color, search.nearest));
+        }
+
+        return search.cache->indices[slot];
+    }
+
+    return static_cast<uchar>(search.grid.nearest(search.table, color, search.nearest));
+}
+
+//! \return Pixel with \a add added to and \a sub subtracted from every color channel, with saturation.
+inline QRgb ditherPixel(QRgb color,
+                        quint32 add,
+                        quint32 sub)
+{
+    const int a = static_cast<int>(add & 0xFF);
+    const int s = static_cast<int>(sub & 0xFF);
+
+    return qRgba(qBound(0, qMin(qRed(color) + a, 255) - s, 255),
+                 qBound(0, qMin(qGreen(color) + a, 255) - s, 255),
+                 qBound(0, qMin(qBlue(color) + a, 255) - s, 255),
+                 qAlpha(color));
+}
+
+//! Apply ordered dithering to the line of 32-bit pixels. Offsets of the pixel x are
+//! \a add[x & 7] and \a sub[x & 7], they hold the same byte in every color channel.
+void ditherLineScalar(const QRgb *line,
+                      int width,
+                      const quint32 *add,
+                      const quint32 *sub,
+                      QRgb *out)
+{
+    for (int x = 0; x < width; ++x) {
+        out[x] = ditherPixel(line[x], add[x & 7], sub[x & 7]);
+    }
+}
+
+//! Map line of 32-bit pixels to indices in the palette.
+void mapLineScalar(const QRgb *line,
+                   int width,
+                   NearestSearch &search,
+                   uchar *indices)
+{
+    quint32 color = InverseColorMap::s_empty;
+    uchar idx = 0;
+
+    for (int x = 0; x < width; ++x) {
+        const quint32 c = packedColor(line[x]);
+
+        if (c != color) {
+            idx = lookupIndex(c, search);
+            color = c;
+        }
+
+        indices[x] = idx;
+    }
+}
+
+#ifdef QGIFLIB_X86_SIMD
+
+//! \return Index of the smallest distance, the lowest index on equal distances.
+inline int bestOf(const qint32 *distances,
+                  const qint32 *idx,
+                  int count)
+{
+    int best = 0;
+
+    for (int i = 1; i < count; ++i) {
+        if (distances[i] < distances[best] || (distances[i] == distances[best] && idx[i] < idx[best])) {
+            best = i;
+        }
+    }
+
+    return idx[best];
+}
+
+//
+// SSE4.1 kernels.
+//
+
+QGIFLIB_TARGET_SSE41
+void boundsSse41(const ColorBucket *buckets,
+                 qsizetype count,
+                 ColorBounds &b)
+{
+    // Counts are in odd 32-bit lanes, they are excluded from minimum and maximum.
+    const __m128i countsMask = _mm_set_epi32(-1, 0, -1, 0);
+    __m128i lowest = _mm_set1_epi8(-1);
+    __m128i highest = _mm_setzero_si128();
+    qsizetype i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buckets + i));
+        lowest = _mm_min_epu8(lowest, _mm_or_si128(v, countsMask));
+        highest = _mm_max_epu8(highest, _mm_andnot_si128(countsMask, v));
+    }
+
+    alignas(16) quint32 l[4];
+    alignas(16) quint32 h[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(l), lowest);
+    _mm_store_si128(reinterpret_cast<__m128i *>(h), highest);
+
+    const ColorBucket tail[4] = {{l[0], 0}, {l[2], 0}, {h[0], 0}, {h[2], 0}};
+    boundsScalar(tail, (count >= 2 ? 4 : 0), b);
+    boundsScalar(buckets + i, count - i, b);
+}
+
+QGIFLIB_TARGET_SSE41
+qsizetype partitionSse41(ColorBucket *buckets,
+                         qsizetype count,
+                         int shift,
+                         unsigned char middle,
+                         ColorBucket *scratch)
+{
+    // Left packing shuffles for 2 buckets by the mask of buckets to keep.
+    static const __m128i s_pack[4] = {_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                      _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                      _mm_setr_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7),
+                                      _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)};
+
+    const __m128i mid = _mm_set1_epi32(middle);
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    qsizetype left = 0;
+    qsizetype right = 0;
+    qsizetype i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buckets + i));
+        const __m128i c = _mm_and_si128(_mm_srl_epi32(v, sh), byteMask);
+        const __m128i lt = _mm_shuffle_epi32(_mm_cmplt_epi32(c, mid), _MM_SHUFFLE(2, 2, 0, 0));
+        const int m = _mm_movemask_pd(_mm_castsi128_pd(lt));
+        const int popCount = (m & 1) + (m >> 1);
+
+        // Left buckets never overwrite not yet loaded ones.
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(buckets + left), _mm_shuffle_epi8(v, s_pack[m]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(scratch + right), _mm_shuffle_epi8(v, s_pack[~m & 3]));
+
+        left += popCount;
+        right += 2 - popCount;
+    }
+
+    for (; i < count; ++i) {
+        const auto b = buckets[i];
+
+        if (static_cast<unsigned char>(b.color >> shift) < middle) {
+            buckets[left++] = b;
+        } else {
+            scratch[right++] = b;
+        }
+    }
+
+    std::copy(scratch, scratch + right, buckets + left);
+
+    return left;
+}
+
+QGIFLIB_TARGET_SSE41
+void sumsSse41(const ColorBucket *buckets,
+               qsizetype count,
+               ColorSums &s)
+{
+    const __m128i byteMask = _mm_set1_epi64x(0xFF);
+    __m128i red = _mm_setzero_si128();
+    __m128i green = _mm_setzero_si128();
+    __m128i blue = _mm_setzero_si128();
+    __m128i total = _mm_setzero_si128();
+    qsizetype i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buckets + i));
+        const __m128i c = _mm_srli_epi64(v, 32);
+
+        red = _mm_add_epi64(red, _mm_mul_epu32(_mm_and_si128(_mm_srli_epi64(v, 16), byteMask), c));
+        green = _mm_add_epi64(green, _mm_mul_epu32(_mm_and_si128(_mm_srli_epi64(v, 8), byteMask), c));
+        blue = _mm_add_epi64(blue, _mm_mul_epu32(_mm_and_si128(v, byteMask), c));
+        total = _mm_add_epi64(total, c);
+    }
+
+    alignas(16) quint64 sums[4][2];
+    _mm_store_si128(reinterpret_cast<__m128i *>(sums[0]), red);
+    _mm_store_si128(reinterpret_cast<__m128i *>(sums[1]), green);
+    _mm_store_si128(reinterpret_cast<__m128i *>(sums[2]), blue);
+    _mm_store_si128(reinterpret_cast<__m128i *>(sums[3]), total);
+
+    s.red += sums[0][0] + sums[0][1];
+    s.green += sums[1][0] + sums[1][1];
+    s.blue += sums[2][0] + sums[2][1];
+    s.count += sums[3][0] + sums[3][1];
+
+    sumsScalar(buckets + i, count - i, s);
+}
+
+QGIFLIB_TARGET_SSE41
+int nearestSse41(const PaletteTable &palette,
+                 quint32 color)
+{
+    const __m128i r = _mm_set1_epi32(redOf(color));
+    const __m128i g = _mm_set1_epi32(greenOf(color));
+    const __m128i b = _mm_set1_epi32(blueOf(color));
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i best = _mm_set1_epi32(std::numeric_limits<qint32>::max());
+    __m128i bestIdx = _mm_setzero_si128();
+
+    for (int i = 0; i < palette.paddedSize; i += 4) {
+        const __m128i dr = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(palette.red + i)), r);
+        const __m128i dg = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(palette.green + i)), g);
+        const __m128i db = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(palette.blue + i)), b);
+        const __m128i d =
+            _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)), _mm_mullo_epi32(db, db));
+        const __m128i lt = _mm_cmplt_epi32(d, best);
+
+        best = _mm_min_epi32(best, d);
+        bestIdx = _mm_blendv_epi8(bestIdx, idx, lt);
+        idx = _mm_add_epi32(idx, step);
+    }
+
+    alignas(16) qint32 distances[4];
+    alignas(16) qint32 indices[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(distances), best);
+    _mm_store_si128(reinterpret_cast<__m128i *>(indices), bestIdx);
+
+    return bestOf(distances, indices, 4);
+}
+
+QGIFLIB_TARGET_SSE41
+void ditherLineSse41(const QRgb *line,
+                     int width,
+                     const quint32 *add,
+                     const quint32 *sub,
+                     QRgb *out)
+{
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(line + x));
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + (x & 7)));
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + (x & 7)));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), _mm_subs_epu8(_mm_adds_epu8(v, a), s));
+    }
+
+    for (; x < width; ++x) {
+        out[x] = ditherPixel(line[x], add[x & 7], sub[x & 7]);
+    }
+}
+
+QGIFLIB_TARGET_SSE41
+void mapLineSse41(const QRgb *line,
+                  int width,
+                  NearestSearch &search,
+                  uchar *indices)
+{
+    const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+    int x = 0;
+
+    while (x < width) {
+        const quint32 color = packedColor(line[x]);
+        const uchar idx = lookupIndex(color, search);
+        const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+
+        indices[x++] = idx;
+
+        // Extend the run of the same color.
+        while (x + 4 <= width) {
+            const __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(line + x)), colorMask);
+            const int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, c)));
+
+            if (m == 0xF) {
+                std::memset(indices + x, idx, 4);
+                x += 4;
+            } else {
+                const int n = qCountTrailingZeroBits(static_cast<quint32>(~m));
+                std::memset(indices + x, idx, n);
+                x += n;
+
+                break;
+            }
+        }
+    }
+}
+
+//
+// AVX2 kernels.
+//
+
+QGIFLIB_TARGET_AVX2
+void boundsAvx2(const ColorBucket *buckets,
+                qsizetype count,
+                ColorBounds &b)
+{
+    // Counts are in odd 32-bit lanes, they are excluded from minimum and maximum.
+    const __m256i countsMask = _mm256_set_epi32(-1, 0, -1, 0, -1, 0, -1, 0);
+    __m256i lowest = _mm256_set1_epi8(-1);
+    __m256i highest = _mm256_setzero_si256();
+    qsizetype i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buckets + i));
+        lowest = _mm256_min_epu8(lowest, _mm256_or_si256(v, countsMask));
+        highest = _mm256_max_epu8(highest, _mm256_andnot_si256(countsMask, v));
+    }
+
+    alignas(32) quint32 l[8];
+    alignas(32) quint32 h[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(l), lowest);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(h), highest);
+
+    const ColorBucket tail[8] =
+        {{l[0], 0}, {l[2], 0}, {l[4], 0}, {l[6], 0}, {h[0], 0}, {h[2], 0}, {h[4], 0}, {h[6], 0}};
+    boundsScalar(tail, (count >= 4 ? 8 : 0), b);
+    boundsScalar(buckets + i, count - i, b);
+}
+
+//! Permutations of 32-bit lanes that pack 4 buckets to the left by the mask of buckets to keep.
+struct PackTableAvx2 {
+    alignas(32) qint32 lanes[16][8];
+
+    PackTableAvx2()
+    {
+        for (int m = 0; m < 16; ++m) {
+            int j = 0;
+
+            for (int e = 0; e < 4; ++e) {
+                if (m & (1 << e)) {
+                    lanes[m][j * 2] = e * 2;
+                    lanes[m][j * 2 + 1] = e * 2 + 1;
+                    ++j;
+                }
+            }
+
+            for (; j < 4; ++j) {
+                lanes[m][j * 2] = j * 2;
+                lanes[m][j * 2 + 1] = j * 2 + 1;
+            }
+        }
+    }
+};
+
+QGIFLIB_TARGET_AVX2
+qsizetype partitionAvx2(ColorBucket *buckets,
+                        qsizetype count,
+                        int shift,
+                        unsigned char middle,
+                        ColorBucket *scratch)
+{
+    static const PackTableAvx2 s_pack;
+
+    const __m256i mid = _mm256_set1_epi64x(middle);
+    const __m256i byteMask = _mm256_set1_epi64x(0xFF);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    qsizetype left = 0;
+    qsizetype right = 0;
+    qsizetype i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buckets + i));
+        const __m256i c = _mm256_and_si256(_mm256_srl_epi64(v, sh), byteMask);
+        const int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(mid, c)));
+        const int popCount = qPopulationCount(static_cast<quint32>(m));
+        const __m256i toLeft = _mm256_load_si256(reinterpret_cast<const __m256i *>(s_pack.lanes[m]));
+        const __m256i toRight = _mm256_load_si256(reinterpret_cast<const __m256i *>(s_pack.lanes[~m & 0xF]));
+
+        // Left buckets never overwrite not yet loaded ones.
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(buckets + left), _mm256_permutevar8x32_epi32(v, toLeft));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(scratch + right), _mm256_permutevar8x32_epi32(v, toRight));
+
+        left += popCount;
+        right += 4 - popCount;
+    }
+
+    for (; i < count; ++i) {
+        const auto b = buckets[i];
+
+        if (static_cast<unsigned char>(b.color >> shift) < middle) {
+            buckets[left++] = b;
+        } else {
+            scratch[right++] = b;
+        }
+    }
+
+    std::copy(scratch, scratch + right, buckets + left);
+
+    return left;
+}
+
+QGIFLIB_TARGET_AVX2
+void sumsAvx2(const ColorBucket *buckets,
+              qsizetype count,
+              ColorSums &s)
+{
+    const __m256i byteMask = _mm256_set1_epi64x(0xFF);
+    __m256i red = _mm256_setzero_si256();
+    __m256i green = _mm256_setzero_si256();
+    __m256i blue = _mm256_setzero_si256();
+    __m256i total = _mm256_setzero_si256();
+    qsizetype i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buckets + i));
+        const __m256i c = _mm256_srli_epi64(v, 32);
+
+        red = _mm256_add_epi64(red, _mm256_mul_epu32(_mm256_and_si256(_mm256_srli_epi64(v, 16), byteMask), c));
+        green = _mm256_add_epi64(green, _mm256_mul_epu32(_mm256_and_si256(_mm256_srli_epi64(v, 8), byteMask), c));
+        blue = _mm256_add_epi64(blue, _mm256_mul_epu32(_mm256_and_si256(v, byteMask), c));
+        total = _mm256_add_epi64(total, c);
+    }
+
+    alignas(32) quint64 sums[4][4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums[0]), red);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums[1]), green);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums[2]), blue);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums[3]), total);
+
+    for (int j = 0; j < 4; ++j) {
+        s.red += sums[0][j];
+        s.green += sums[1][j];
+        s.blue += sums[2][j];
+        s.count += sums[3][j];
+    }
+
+    sumsScalar(buckets + i, count - i, s);
+}
+
+QGIFLIB_TARGET_AVX2
+int nearestAvx2(const PaletteTable &palette,
+                quint32 color)
+{
+    const __m256i r = _mm256_set1_epi32(redOf(color));
+    const __m256i g = _mm256_set1_epi32(greenOf(color));
+    const __m256i b = _mm256_set1_epi32(blueOf(color));
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i best = _mm256_set1_epi32(std::numeric_limits<qint32>::max());
+    __m256i bestIdx = _mm256_setzero_si256();
+
+    for (int i = 0; i < palette.paddedSize; i += 8) {
+        const __m256i dr = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i *>(palette.red + i)), r);
+        const __m256i dg =
+            _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i *>(palette.green + i)), g);
+        const __m256i db = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i *>(palette.blue + i)), b);
+        const __m256i d = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+                                           _mm256_mullo_epi32(db, db));
+        const __m256i lt = _mm256_cmpgt_epi32(best, d);
+
+        best = _mm256_min_epi32(best, d);
+        bestIdx = _mm256_blendv_epi8(bestIdx, idx, lt);
+        idx = _mm256_add_epi32(idx, step);
+    }
+
+    alignas(32) qint32 distances[8];
+    alignas(32) qint32 indices[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(distances), best);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices), bestIdx);
+
+    return bestOf(distances, indices, 8);
+}
+
+QGIFLIB_TARGET_AVX2
+void ditherLineAvx2(const QRgb *line,
+                    int width,
+                    const quint32 *add,
+                    const quint32 *sub,
+                    QRgb *out)
+{
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(add));
+    const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sub));
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(line + x));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x), _mm256_subs_epu8(_mm256_adds_epu8(v, a), s));
+    }
+
+    for (; x < width; ++x) {
+        out[x] = ditherPixel(line[x], add[x & 7], sub[x & 7]);
+    }
+}
+
+QGIFLIB_TARGET_AVX2
+void mapLineAvx2(const QRgb *line,
+                 int width,
+                 NearestSearch &search,
+                 uchar *indices)
+{
+    const __m256i colorMask = _mm256_set1_epi32(0x00FFFFFF);
+    int x = 0;
+
+    while (x < width) {
+        const quint32 color = packedColor(line[x]);
+        const uchar idx = lookupIndex(color, search);
+        const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+
+        indices[x++] = idx;
+
+        // Extend the run of the same color.
+        while (x + 8 <= width) {
+            const __m256i v =
+                _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(line + x)), colorMask);
+            const int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, c)));
+
+            if (m == 0xFF) {
+                std::memset(indices + x, idx, 8);
+                x += 8;
+            } else {
+                const int n = qCountTrailingZeroBits(static_cast<quint32>(~m));
+                std::memset(indices + x, idx, n);
+                x += n;
+
+                break;
+            }
+        }
+    }
+}
+
+#endif // QGIFLIB_X86_SIMD
+
+//! Quantizer kernels for one instruction set.
+struct Kernels {
+    void (*bounds)(const ColorBucket *,
+                   qsizetype,
+                   ColorBounds &);
+    qsizetype (*partition)(ColorBucket *,
+                           qsizetype,
+                           int,
+                           unsigned char,
+                           ColorBucket *);
+    void (*sums)(const ColorBucket *,
+                 qsizetype,
+                 ColorSums &);
+    int (*nearest)(const PaletteTable &,
+                   quint32);
+    void (*mapLine)(const QRgb *,
+                    int,
+                    NearestSearch &,
+                    uchar *);
+    void (*ditherLine)(const QRgb *,
+                       int,
+                       const quint32 *,
+                       const quint32 *,
+                       QRgb *);
+};
+
+//! \return Instruction set supported by CPU.
+SimdLevel detectSimdLevel()
+{
+#ifdef QGIFLIB_X86_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4] = {0, 0, 0, 0};
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    if (maxLeaf < 1) {
+        return SimdLevel::Scalar;
+    }
+
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19));
+    const bool osxsave = (info[2] & (1 << 27));
+    const bool avx = (info[2] & (1 << 28));
+
+    // Only AVX2 needs leaf 7.
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5));
+
+        if (avx2 && avx && osxsave && (_xgetbv(0) & 0x6) == 0x6) {
+            return SimdLevel::AVX2;
+        }
+    }
+
+    if (sse41) {
+        return SimdLevel::SSE41;
+    }
+#else
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+
+    if (__builtin_cpu_supports("sse4.1")) {
+        return SimdLevel::SSE41;
+    }
+#endif
+#endif // QGIFLIB_X86_SIMD
+
+    return SimdLevel::Scalar;
+}
+
+SimdLevel supportedSimdLevel()
+{
+    static const SimdLevel s_level = detectSimdLevel();
+
+    return s_level;
+}
+
+std::atomic<SimdLevel> s_maxSimdLevel = SimdLevel::AVX2;
+
+//! \return Kernels for the current SIMD level.
+const Kernels &kernels()
+{
+    static const Kernels s_scalar = {boundsScalar, partitionScalar, sumsScalar, nearestScalar, mapLineScalar, ditherLineScalar};
+
+#ifdef QGIFLIB_X86_SIMD
+    static const Kernels s_sse41 = {boundsSse41, partitionSse41, sumsSse41, nearestSse41, mapLineSse41, ditherLineSse41};
+    static const Kernels s_avx2 = {boundsAvx2, partitionAvx2, sumsAvx2, nearestAvx2, mapLineAvx2, ditherLineAvx2};
+
+    switch (simdLevel()) {
+    case SimdLevel::AVX2:
+        return s_avx2;
+
+    case SimdLevel::SSE41:
+        return s_sse41;
+
+    default:
+        break;
+    }
+#endif // QGIFLIB_X86_SIMD
+
+    return s_scalar;
+}
+
+//! Weights of components on choosing the longest side of the box.
+struct SideWeights {
+    float red;
+    float green;
+    float blue;
+};
+
+//! Luma weights of RGB.
+const SideWeights s_rgbWeights = {0.299f, 0.587f, 0.114f};
+//! Perceptual color spaces are scaled uniformly.
+const SideWeights s_uniformWeights = {1.0f, 1.0f, 1.0f};
+
+QPair<ColorComponent,
+      ColorRange>
+longestSide(const ColorBucket *buckets,
+            const ColorBox &box,
+            const SideWeights &weights)
+{
+    ColorBounds bounds;
+    kernels().bounds(buckets + box.begin, box.size(), bounds);
+
+    const auto &red = bounds.red;
+    const auto &green = bounds.green;
+    const auto &blue = bounds.blue;
+
+    unsigned char redDistance = qRound((float)(red.highest - red.lowest) * weights.red);
+    unsigned char greenDistance = qRound((float)(green.highest - green.lowest) * weights.green);
+    unsigned char blueDistance = qRound((float)(blue.highest - blue.lowest) * weights.blue);
+
+    // On equal distances the last component wins.
+    if (blueDistance >= greenDistance && blueDistance >= redDistance) {
+        return {Blue, blue};
+    } else if (greenDistance >= redDistance) {
+        return {Green, green};
+    } else {
+        return {Red, red};
+    }
+}
+
+//! Split the box into \a halves by the middle of the longest side. \a scratch is a buffer of the size of the box.
+void splitByLongestSide(ColorBucket *buckets,
+                        ColorBucket *scratch,
+                        const ColorBox &box,
+                        const SideWeights &weights,
+                        ColorBox *halves)
+{
+    qsizetype middleIdx = box.begin;
+
+    if (!box.isEmpty()) {
+        const auto side = longestSide(buckets, box, weights);
+        const unsigned char middle = (side.second.highest - side.second.lowest) / 2 + side.second.lowest;
+        const int shift = (side.first == Red ? 16 : (side.first == Green ? 8 : 0));
+
+        middleIdx = box.begin + kernels().partition(buckets + box.begin, box.size(), shift, middle, scratch);
+    }
+
+    halves[0] = {box.begin, middleIdx};
+    halves[1] = {middleIdx, box.end};
+}
+
+//
+// Median cut.
+//
+
+//! Buffers of median cut, they are reused between palettes.
+struct MedianCutScratch {
+    std::vector<ColorBucket> buckets;
+    std::vector<ColorBox> boxes;
+    //! Count of pixels and box index.
+    std::vector<std::pair<quint64, qsizetype>> order;
+    //! Boxes to split and their halves.
+    std::vector<qsizetype> toSplit;
+    std::vector<ColorBox> halves;
+    //! Sums of colors of boxes.
+    std::vector<ColorSums> sums;
+    std::vector<qsizetype> emptyIdx;
+    //! Box index and bucket.
+    std::vector<std::pair<qsizetype, ColorBucket>> colorsCount;
+    ParallelTasks tasks;
+};
+
+//! Minimum count of buckets in boxes split by one thread.
+const qsizetype s_minSplitBucketsPerStripe = 1 << 14;
+
+//! \return Count of stripes for processing of \a boxes boxes of \a buckets buckets in total.
+int boxStripesCount(qsizetype boxes,
+                    qsizetype buckets,
+                    const QuantizeOptions &options)
+{
+    return static_cast<int>(qMin(static_cast<qsizetype>(stripesCount(buckets, s_minSplitBucketsPerStripe, options)), boxes));
+}
+
+//! Sum colors of boxes in parallel.
+void sumBoxes(const std::vector<ColorBucket> &buckets,
+              const std::vector<ColorBox> &boxes,
+              const QuantizeOptions &options,
+              ParallelTasks &tasks,
+              std::vector<ColorSums> &sums)
+{
+    sums.assign(boxes.size(), {});
+
+    parallelFor(static_cast<qsizetype>(boxes.size()),
+                boxStripesCount(static_cast<qsizetype>(boxes.size()), static_cast<qsizetype>(buckets.size()), options),
+                options,
+                tasks,
+                [&](int, qsizetype first, qsizetype last) {
+                    for (qsizetype i = first; i < last; ++i) {
+                        kernels().sums(buckets.data() + boxes[i].begin, boxes[i].size(), sums[i]);
+                    }
+                });
+}
+
+//! Build palette of \a k colors by median cut. Boxes are disjoint ranges of buckets, so boxes
+//! of one level are split in parallel, the result doesn't depend on count of threads.
+void medianCutPalette(std::vector<ColorBucket> &buckets,
+                      long long int k,
+                      const SideWeights &weights,
+                      const QuantizeOptions &options,
+                      MedianCutScratch &scratch,
+                      QList<QRgb> &colors,
+                      InverseColorMap &inverse)
+{
+    const auto count = static_cast<qsizetype>(buckets.size());
+
+    scratch.buckets.resize(buckets.size() + 4);
+
+    auto &indexed = scratch.boxes;
+    indexed.clear();
+    indexed.push_back({0, count});
+
+    // Split boxes with the given indices, halves are stored in scratch.halves.
+    const auto split = [&](const std::vector<qsizetype> &boxes) {
+        scratch.halves.resize(boxes.size() * 2);
+
+        parallelFor(static_cast<qsizetype>(boxes.size()),
+                    boxStripesCount(static_cast<qsizetype>(boxes.size()), count, options),
+                    options,
+                    scratch.tasks,
+                    [&](int, qsizetype first, qsizetype last) {
+                        for (qsizetype i = first; i < last; ++i) {
+                            const auto &box = indexed[boxes[i]];
+
+                            splitByLongestSide(buckets.data(),
+                                               scratch.buckets.data() + box.begin,
+                                               box,
+                                               weights,
+                                               scratch.halves.data() + i * 2);
+                        }
+                    });
+    };
+
+    auto &toSplit = scratch.toSplit;
+
+    // split by colors cube.
+    while (static_cast<long long int>(indexed.size()) * 2 <= k) {
+        toSplit.resize(indexed.size());
+        std::iota(toSplit.begin(), toSplit.end(), 0);
+
+        split(toSplit);
+
+        std::swap(indexed, scratch.halves);
+    }
+
+    // If k is not a power of 2 boxes with the most pixels are split once more.
+    if (static_cast<long long int>(indexed.size()) < k) {
+        sumBoxes(buckets, indexed, options, scratch.tasks, scratch.sums);
+
+        // Ordered by count and then by index.
+        auto &order = scratch.order;
+        order.clear();
+
+        for (qsizetype i = 0; i < static_cast<qsizetype>(indexed.size()); ++i) {
+            order.push_back({scratch.sums[i].count, i});
+        }
+
+        std::sort(order.begin(), order.end(), [](const auto &l, const auto &r) {
+            return (l.first > r.first || (l.first == r.first && l.second < r.second));
+        });
+
+        const auto extra = static_cast<size_t>(k - static_cast<long long int>(indexed.size()));
+
+        toSplit.clear();
+
+        for (size_t i = 0; i < extra; ++i) {
+            toSplit.push_back(order[i].second);
+        }
+
+        split(toSplit);
+
+        for (size_t i = 0; i < extra; ++i) {
+            indexed[toSplit[i]] = scratch.halves[i * 2];
+            indexed.push_back(scratch.halves[i * 2 + 1]);
+        }
+    }
+
+    // Separate most common colors if we have empty slots.
+    auto &emptyIdx = scratch.emptyIdx;
+    emptyIdx.clear();
+
+    for (auto i = 0; i < k; ++i) {
+        if (indexed[i].isEmpty()) {
+            emptyIdx.push_back(i);
+        }
+    }
+
+    if (!emptyIdx.empty()) {
+        // Ordered by count and then by color to not depend on buckets order.
+        auto &colorsCount = scratch.colorsCount;
+        colorsCount.clear();
+
+        for (auto i = 0; i < k; ++i) {
+            for (qsizetype j = indexed[i].begin; j < indexed[i].end; ++j) {
+                colorsCount.push_back({i, buckets[j]});
+            }
+        }
+
+        std::sort(colorsCount.begin(), colorsCount.end(), [](const auto &l, const auto &r) {
+            return (l.second.count > r.second.count
+                    || (l.second.count == r.second.count && l.second.color < r.second.color));
+        });
+
+        auto emptyIt = emptyIdx.cbegin();
+
+        for (const auto &c : std::as_const(colorsCount)) {
+            auto &box = indexed[c.first];
+
+            if (box.size() > 1) {
+                // Move bucket to the end of its box and give it to the empty box.
+                const auto it = std::find_if(buckets.begin() + box.begin,
+                                             buckets.begin() + box.end,
+                                             [&c](const ColorBucket &b) {
+                                                 return b.color == c.second.color;
+                                             });
+
+                std::iter_swap(it, buckets.begin() + box.end - 1);
+
+                --box.end;
+                indexed[*emptyIt] = {box.end, box.end + 1};
+
+                ++emptyIt;
+            }
+
+            if (emptyIt == emptyIdx.cend()) {
+                break;
+            }
+        }
+    }
+
+    sumBoxes(buckets, indexed, options, scratch.tasks, scratch.sums);
+
+    for (qsizetype i = 0; i < k; ++i) {
+        const auto &sums = scratch.sums[i];
+
+        colors.push_back(sums.count ? qRgb(sums.red / sums.count, sums.green / sums.count, sums.blue / sums.count)
+                                    : qRgb(0, 0, 0));
+
+        for (qsizetype j = indexed[i].begin; j < indexed[i].end; ++j) {
+            inverse.value(buckets[j].color) = static_cast<uchar>(i);
+        }
+    }
+}
+
+//
+// WuQuantizer
+//
+
+//! Xiaolin Wu's quantizer, "Efficient Statistical Computations for Optimal Color Quantization",
+//! Graphics Gems II. Colors are reduced to 5 bits per component, boxes are split to minimize
+//! sum of variances.
+class WuQuantizer
+{
+public:
+    //! Side of the moments cube, 32 values of component and zero plane.
+    static constexpr int s_side = 33;
+
+    //! Build palette of at most \a k colors. Quantizer can be reused, memory is kept.
+    void palette(const std::vector<ColorBucket> &buckets,
+                 long long int k,
+                 QList<QRgb> &colors,
+                 InverseColorMap &inverse)
+    {
+        // Moments are allocated on the first palette.
+        for (auto *m : {&m_weights, &m_red, &m_green, &m_blue, &m_squares}) {
+            m->assign(s_side * s_side * s_side, 0);
+        }
+
+        for (const auto &b : buckets) {
+            const qint64 r = redOf(b.color);
+            const qint64 g = greenOf(b.color);
+            const qint64 bl = blueOf(b.color);
+            const auto i = index((r >> 3) + 1, (g >> 3) + 1, (bl >> 3) + 1);
+
+            m_weights[i] += b.count;
+            m_red[i] += r * b.count;
+            m_green[i] += g * b.count;
+            m_blue[i] += bl * b.count;
+            m_squares[i] += (r * r + g * g + bl * bl) * b.count;
+        }
+
+        buildMoments();
+
+        auto &boxes = m_boxes;
+        auto &variances = m_variances;
+        boxes.assign(k, {});
+        variances.assign(k, 0.0);
+        boxes[0] = {0, s_side - 1, 0, s_side - 1, 0, s_side - 1};
+
+        int next = 0;
+        long long int count = k;
+
+        for (long long int i = 1; i < count; ++i) {
+            if (cut(boxes[next], boxes[i])) {
+                variances[next] = (volume(boxes[next]) > 1 ? variance(boxes[next]) : 0.0);
+                variances[i] = (volume(boxes[i]) > 1 ? variance(boxes[i]) : 0.0);
+            } else {
+                variances[next] = 0.0;
+                --i;
+            }
+
+            next = 0;
+            double maxVariance = variances[0];
+
+            for (long long int j = 1; j <= i; ++j) {
+                if (variances[j] > maxVariance) {
+                    maxVariance = variances[j];
+                    next = j;
+                }
+            }
+
+            if (maxVariance <= 0.0) {
+                count = i + 1;
+
+                break;
+            }
+        }
+
+        auto &tags = m_tags;
+        tags.assign(m_weights.size(), 0);
+
+        for (long long int i = 0; i < count; ++i) {
+            const auto &b = boxes[i];
+            const qint64 weight = sum(b, m_weights);
+
+            colors.push_back(weight ? qRgb(sum(b, m_red) / weight, sum(b, m_green) / weight, sum(b, m_blue) / weight)
+                                    : qRgb(0, 0, 0));
+
+            for (int r = b.r0 + 1; r <= b.r1; ++r) {
+                for (int g = b.g0 + 1; g <= b.g1; ++g) {
+                    for (int bl = b.b0 + 1; bl <= b.b1; ++bl) {
+                        tags[index(r, g, bl)] = static_cast<uchar>(i);
+                    }
+                }
+            }
+        }
+
+        for (const auto &b : buckets) {
+            inverse.value(b.color) =
+                tags[index((redOf(b.color) >> 3) + 1, (greenOf(b.color) >> 3) + 1, (blueOf(b.color) >> 3) + 1)];
+        }
+    }
+
+private:
+    //! Box of the cube, lower bounds are exclusive.
+    struct Box {
+        int r0 = 0;
+        int r1 = 0;
+        int g0 = 0;
+        int g1 = 0;
+        int b0 = 0;
+        int b1 = 0;
+    };
+
+    static int index(int r,
+                     int g,
+                     int b)
+    {
+        return (r * s_side + g) * s_side + b;
+    }
+
+    static int volume(const Box &b)
+    {
+        return (b.r1 - b.r0) * (b.g1 - b.g0) * (b.b1 - b.b0);
+    }
+
+    //! Convert moments to cumulative ones.
+    void buildMoments()
+    {
+        for (int r = 1; r < s_side; ++r) {
+            qint64 areaW[s_side] = {}, areaR[s_side] = {}, areaG[s_side] = {}, areaB[s_side] = {};
+            qint64 area2[s_side] = {};
+
+            for (int g = 1; g < s_side; ++g) {
+                qint64 lineW = 0, lineR = 0, lineG = 0, lineB = 0, line2 = 0;
+
+                for (int b = 1; b < s_side; ++b) {
+                    const int i = index(r, g, b);
+                    const int prev = index(r - 1, g, b);
+
+                    lineW += m_weights[i];
+                    lineR += m_red[i];
+                    lineG += m_green[i];
+                    lineB += m_blue[i];
+                    line2 += m_squares[i];
+
+                    areaW[b] += lineW;
+                    areaR[b] += lineR;
+                    areaG[b] += lineG;
+                    areaB[b] += lineB;
+                    area2[b] += line2;
+
+                    m_weights[i] = m_weights[prev] + areaW[b];
+                    m_red[i] = m_red[prev] + areaR[b];
+                    m_green[i] = m_green[prev] + areaG[b];
+                    m_blue[i] = m_blue[prev] + areaB[b];
+                    m_squares[i] = m_squares[prev] + area2[b];
+                }
+            }
+        }
+    }
+
+    //! \return Sum of the moment in the box.
+    static qint64 sum(const Box &b,
+                      const std::vector<qint64> &m)
+    {
+        return m[index(b.r1, b.g1, b.b1)] - m[index(b.r1, b.g1, b.b0)] - m[index(b.r1, b.g0, b.b1)]
+            + m[index(b.r1, b.g0, b.b0)] - m[index(b.r0, b.g1, b.b1)] + m[index(b.r0, b.g1, b.b0)]
+            + m[index(b.r0, b.g0, b.b1)] - m[index(b.r0, b.g0, b.b0)];
+    }
+
+    //! \return Part of the sum of the moment in the box that doesn't depend on the cut position.
+    static qint64 bottom(const Box &b,
+                         ColorComponent dir,
+                         const std::vector<qint64> &m)
+    {
+        switch (dir) {
+        case Red:
+            return -m[index(b.r0, b.g1, b.b1)] + m[index(b.r0, b.g1, b.b0)] + m[index(b.r0, b.g0, b.b1)]
+                - m[index(b.r0, b.g0, b.b0)];
+
+        case Green:
+            return -m[index(b.r1, b.g0, b.b1)] + m[index(b.r1, b.g0, b.b0)] + m[index(b.r0, b.g0, b.b1)]
+                - m[index(b.r0, b.g0, b.b0)];
+
+        default:
+            return -m[index(b.r1, b.g1, b.b0)] + m[index(b.r1, b.g0, b.b0)] + m[index(b.r0, b.g1, b.b0)]
+                - m[index(b.r0, b.g0, b.b0)];
+        }
+    }
+
+    //! \return Part of the sum of the moment in the box that depends on the cut position.
+    static qint64 top(const Box &b,
+                      ColorComponent dir,
+                      int pos,
+                      const std::vector<qint64> &m)
+    {
+        switch (dir) {
+        case Red:
+            return m[index(pos, b.g1, b.b1)] - m[index(pos, b.g1, b.b0)] - m[index(pos, b.g0, b.b1)]
+                + m[index(pos, b.g0, b.b0)];
+
+        case Green:
+            return m[index(b.r1, pos, b.b1)] - m[index(b.r1, pos, b.b0)] - m[index(b.r0, pos, b.b1)]
+                + m[index(b.r0, pos, b.b0)];
+
+        default:
+            return m[index(b.r1, b.g1, pos)] - m[index(b.r1, b.g0, pos)] - m[index(b.r0, b.g1, pos)]
+                + m[index(b.r0, b.g0, pos)];
+        }
+    }
+
+    //! \return Weighted variance of the box.
+    double variance(const Box &b) const
+    {
+        const double r = sum(b, m_red);
+        const double g = sum(b, m_green);
+        const double bl = sum(b, m_blue);
+        const double w = sum(b, m_weights);
+
+        return (w > 0.0 ? static_cast<double>(sum(b, m_squares)) - (r * r + g * g + bl * bl) / w : 0.0);
+    }
+
+    //! \return Maximum of the sum of variances' reductions of both halves, \a cutPos is -1 if the box can't be cut.
+    double maximize(const Box &b,
+                    ColorComponent dir,
+                    int first,
+                    int last,
+                    int &cutPos,
+                    qint64 wholeR,
+                    qint64 wholeG,
+                    qint64 wholeB,
+                    qint64 wholeW) const
+    {
+        const qint64 baseR = bottom(b, dir, m_red);
+        const qint64 baseG = bottom(b, dir, m_green);
+        const qint64 baseB = bottom(b, dir, m_blue);
+        const qint64 baseW = bottom(b, dir, m_weights);
+
+        double max = 0.0;
+        cutPos = -1;
+
+        for (int i = first; i < last; ++i) {
+            double halfR = baseR + top(b, dir, i, m_red);
+            double halfG = baseG + top(b, dir, i, m_green);
+            double halfB = baseB + top(b, dir, i, m_blue);
+            qint64 halfW = baseW + top(b, dir, i, m_weights);
+
+            if (halfW == 0) {
+                continue;
+            }
+
+            double temp = (halfR * halfR + halfG * halfG + halfB * halfB) / halfW;
+
+            halfR = wholeR - halfR;
+            halfG = wholeG - halfG;
+            halfB = wholeB - halfB;
+            halfW = wholeW - halfW;
+
+            if (halfW == 0) {
+                continue;
+            }
+
+            temp += (halfR * halfR + halfG * halfG + halfB * halfB) / halfW;
+
+            if (temp > max) {
+                max = temp;
+                cutPos = i;
+            }
+        }
+
+        return max;
+    }
+
+    //! Cut box \a set1, upper part goes to \a set2.
+    bool cut(Box &set1,
+             Box &set2) const
+    {
+        const qint64 wholeR = sum(set1, m_red);
+        const qint64 wholeG = sum(set1, m_green);
+        const qint64 wholeB = sum(set1, m_blue);
+        const qint64 wholeW = sum(set1, m_weights);
+
+        int cutR = -1, cutG = -1, cutB = -1;
+
+        const double maxR = maximize(set1, Red, set1.r0 + 1, set1.r1, cutR, wholeR, wholeG, wholeB, wholeW);
+        const double maxG = maximize(set1, Green, set1.g0 + 1, set1.g1, cutG, wholeR, wholeG, wholeB, wholeW);
+        const double maxB = maximize(set1, Blue, set1.b0 + 1, set1.b1, cutB, wholeR, wholeG, wholeB, wholeW);
+
+        ColorComponent dir = Blue;
+
+        if (maxR >= maxG && maxR >= maxB) {
+            dir = Red;
+
+            if (cutR < 0) {
+                return false;
+            }
+        } else if (maxG >= maxR && maxG >= maxB) {
+            dir = Green;
+        }
+
+        set2.r1 = set1.r1;
+        set2.g1 = set1.g1;
+        set2.b1 = set1.b1;
+
+        switch (dir) {
+        case Red:
+            set2.r0 = set1.r1 = cutR;
+            set2.g0 = set1.g0;
+            set2.b0 = set1.b0;
+            break;
+
+        case Green:
+            set2.g0 = set1.g1 = cutG;
+            set2.r0 = set1.r0;
+            set2.b0 = set1.b0;
+            break;
+
+        default:
+            set2.b0 = set1.b1 = cutB;
+            set2.r0 = set1.r0;
+            set2.g0 = set1.g0;
+            break;
+        }
+
+        return true;
+    }
+
+private:
+    std::vector<qint64> m_weights;
+    std::vector<qint64> m_red;
+    std::vector<qint64> m_green;
+    std::vector<qint64> m_blue;
+    std::vector<qint64> m_squares;
+    std::vector<Box> m_boxes;
+    std::vector<double> m_variances;
+    std::vector<uchar> m_tags;
+}; // class WuQuantizer
+
+//
+// Octree
+//
+
+//! Octree quantizer, the tree never has more than K + 8 leaves, so memory is bounded.
+class Octree
+{
+public:
+    //! Make empty tree with at most \a maxLeaves leaves, memory of the previous tree is reused.
+    void reset(long long int maxLeaves)
+    {
+        m_maxLeaves = maxLeaves;
+        m_leaves = 0;
+
+        m_nodes.clear();
+        m_nodes.reserve(maxLeaves * 4);
+        m_nodes.push_back({});
+        m_free.clear();
+
+        std::fill(std::begin(m_reducible), std::end(m_reducible), -1);
+        m_reducible[0] = 0;
+    }
+
+    //! Build palette of at most maxLeaves colors.
+    void palette(std::vector<ColorBucket> &buckets,
+                 QList<QRgb> &colors,
+                 InverseColorMap &inverse)
+    {
+        // Reduction depends on order of insertion, so order is fixed.
+        std::sort(buckets.begin(), buckets.end(), [](const ColorBucket &l, const ColorBucket &r) {
+            return l.color < r.color;
+        });
+
+        for (const auto &b : std::as_const(buckets)) {
+            insert(b);
+
+            while (m_leaves > m_maxLeaves) {
+                reduce();
+            }
+        }
+
+        assignIndices(0, colors);
+
+        for (const auto &b : std::as_const(buckets)) {
+            inverse.value(b.color) = static_cast<uchar>(m_nodes[leafOf(b.color)].index);
+        }
+    }
+
+private:
+    static constexpr int s_depth = 8;
+
+    struct Node {
+        quint64 red = 0;
+        quint64 green = 0;
+        quint64 blue = 0;
+        quint64 count = 0;
+        qint32 children[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+        //! Next reducible node on the same level.
+        qint32 next = -1;
+        qint32 index = 0;
+        bool leaf = false;
+    };
+
+    static int childIndex(quint32 color,
+                          int level)
+    {
+        const int shift = s_depth - 1 - level;
+
+        return (((redOf(color) >> shift) & 1) << 2) | (((greenOf(color) >> shift) & 1) << 1)
+            | ((blueOf(color) >> shift) & 1);
+    }
+
+    qint32 newNode(int level)
+    {
+        qint32 n = -1;
+
+        if (!m_free.empty()) {
+            n = m_free.back();
+            m_free.pop_back();
+            m_nodes[n] = {};
+        } else {
+            n = static_cast<qint32>(m_nodes.size());
+            m_nodes.push_back({});
+        }
+
+        if (level == s_depth) {
+            m_nodes[n].leaf = true;
+            ++m_leaves;
+        } else {
+            m_nodes[n].next = m_reducible[level];
+            m_reducible[level] = n;
+        }
+
+        return n;
+    }
+
+    void insert(const ColorBucket &b)
+    {
+        qint32 n = 0;
+
+        for (int level = 0; !m_nodes[n].leaf; ++level) {
+            const int c = childIndex(b.color, level);
+
+            if (m_nodes[n].children[c] < 0) {
+                const qint32 child = newNode(level + 1);
+                m_nodes[n].children[c] = child;
+            }
+
+            n = m_nodes[n].children[c];
+        }
+
+        auto &node = m_nodes[n];
+        node.red += redOf(b.color) * (quint64)b.count;
+        node.green += greenOf(b.color) * (quint64)b.count;
+        node.blue += blueOf(b.color) * (quint64)b.count;
+        node.count += b.count;
+    }
+
+    //! Merge children of the deepest reducible node into it.
+    void reduce()
+    {
+        int level = s_depth - 1;
+
+        while (level > 0 && m_reducible[level] < 0) {
+            --level;
+        }
+
+        const qint32 n = m_reducible[level];
+        m_reducible[level] = m_nodes[n].next;
+
+        auto &node = m_nodes[n];
+        int children = 0;
+
+        for (auto &c : node.children) {
+            if (c >= 0) {
+                node.red += m_nodes[c].red;
+                node.green += m_nodes[c].green;
+                node.blue += m_nodes[c].blue;
+                node.count += m_nodes[c].count;
+                m_free.push_back(c);
+                c = -1;
+                ++children;
+            }
+        }
+
+        node.leaf = true;
+        m_leaves -= children - 1;
+    }
+
+    void assignIndices(qint32 n,
+                       QList<QRgb> &colors)
+    {
+        auto &node = m_nodes[n];
+
+        if (node.leaf) {
+            node.index = static_cast<qint32>(colors.size());
+            colors.push_back(node.count ? qRgb(node.red / node.count, node.green / node.count, node.blue / node.count)
+                                        : qRgb(0, 0, 0));
+        } else {
+            for (const auto c : node.children) {
+                if (c >= 0) {
+                    assignIndices(c, colors);
+                }
+            }
+        }
+    }
+
+    qint32 leafOf(quint32 color) const
+    {
+        qint32 n = 0;
+
+        for (int level = 0; !m_nodes[n].leaf; ++level) {
+            n = m_nodes[n].children[childIndex(color, level)];
+        }
+
+        return n;
+    }
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<qint32> m_free;
+    qint32 m_reducible[s_depth];
+    long long int m_leaves = 0;
+    long long int m_maxLeaves = 0;
+}; // class Octree
+
+//
+// Color spaces.
+//
+
+//! Conversion of colors between RGB and perceptual color space. Components of the space are
+//! packed as 8-bit values in place of red, green and blue. Conversion to the space uses only
+//! integer tables, conversion back is for palette colors and uses floating point.
+class ColorSpaceConverter
+{
+public:
+    //! \return Converter for the color space, tables are built once.
+    static const ColorSpaceConverter &instance(ColorSpace space)
+    {
+        if (space == ColorSpace::Oklab) {
+            static const ColorSpaceConverter s_oklab(ColorSpace::Oklab);
+
+            return s_oklab;
+        } else {
+            static const ColorSpaceConverter s_ycbcr(ColorSpace::YCbCr);
+
+            return s_ycbcr;
+        }
+    }
+
+    //! \return Packed color in the color space.
+    quint32 to(quint32 color) const
+    {
+        const int r = redOf(color);
+        const int g = greenOf(color);
+        const int b = blueOf(color);
+
+        if (m_space == ColorSpace::YCbCr) {
+            return pack((m_coeffs[0][0][r] + m_coeffs[0][1][g] + m_coeffs[0][2][b] + s_half) >> s_bits,
+                        (m_coeffs[1][0][r] + m_coeffs[1][1][g] + m_coeffs[1][2][b] + s_half) >> s_bits,
+                        (m_coeffs[2][0][r] + m_coeffs[2][1][g] + m_coeffs[2][2][b] + s_half) >> s_bits);
+        }
+
+        // Linear RGB to cone responses, then cube root by the table.
+        const int l = m_cbrt[lms(0, r, g, b)];
+        const int m = m_cbrt[lms(1, r, g, b)];
+        const int s = m_cbrt[lms(2, r, g, b)];
+
+        return pack((m_lab[0][0] * l + m_lab[0][1] * m + m_lab[0][2] * s + s_labHalf) >> s_labBits,
+                    ((m_lab[1][0] * l + m_lab[1][1] * m + m_lab[1][2] * s + s_labHalf) >> s_labBits) + 128,
+                    ((m_lab[2][0] * l + m_lab[2][1] * m + m_lab[2][2] * s + s_labHalf) >> s_labBits) + 128);
+    }
+
+    //! \return RGB color of the packed color of the space.
+    QRgb from(QRgb color) const
+    {
+        const double c0 = qRed(color);
+        const double c1 = qGreen(color);
+        const double c2 = qBlue(color);
+
+        if (m_space == ColorSpace::YCbCr) {
+            return qRgb(clamp(c0 + 1.402 * (c2 - 128.0)),
+                        clamp(c0 - 0.344136 * (c1 - 128.0) - 0.714136 * (c2 - 128.0)),
+                        clamp(c0 + 1.772 * (c1 - 128.0)));
+        }
+
+        const double L = c0 / 255.0;
+        const double a = (c1 - 128.0) / 255.0;
+        const double b = (c2 - 128.0) / 255.0;
+
+        const double l = std::pow(L + 0.3963377774 * a + 0.2158037573 * b, 3.0);
+        const double m = std::pow(L - 0.1055613458 * a - 0.0638541728 * b, 3.0);
+        const double s = std::pow(L - 0.0894841775 * a - 1.2914855480 * b, 3.0);
+
+        return qRgb(clamp(255.0 * toSrgb(4.0767416621 * l - 3.3077115913 * m + 0.2309699292 * s)),
+                    clamp(255.0 * toSrgb(-1.2684380046 * l + 2.6097574011 * m - 0.3413193965 * s)),
+                    clamp(255.0 * toSrgb(-0.0041960863 * l - 0.7034186147 * m + 1.7076147010 * s)));
+    }
+
+private:
+    explicit ColorSpaceConverter(ColorSpace space)
+        : m_space(space)
+    {
+        if (space == ColorSpace::YCbCr) {
+            // ITU-R BT.601 full range.
+            static const double s_matrix[3][3] = {{0.299, 0.587, 0.114},
+                                                  {-0.168736, -0.331264, 0.5},
+                                                  {0.5, -0.418688, -0.081312}};
+
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    for (int v = 0; v < 256; ++v) {
+                        m_coeffs[i][j][v] = static_cast<qint32>(std::lround(s_matrix[i][j] * v * (1 << s_bits)));
+                    }
+                }
+
+                // Chroma is centered at 128.
+                if (i > 0) {
+                    for (int v = 0; v < 256; ++v) {
+                        m_coeffs[i][0][v] += 128 << s_bits;
+                    }
+                }
+            }
+
+            return;
+        }
+
+        // Björn Ottosson's Oklab, matrix of linear RGB to cone responses.
+        static const double s_lms[3][3] = {{0.4122214708, 0.5363325363, 0.0514459929},
+                                           {0.2119034982, 0.6806995451, 0.1073969566},
+                                           {0.0883024619, 0.2817188376, 0.6299787005}};
+        static const double s_lab[3][3] = {{0.2104542553, 0.7936177850, -0.0040720468},
+                                           {1.9779984951, -2.4285922050, 0.4505937099},
+                                           {0.0259040371, 0.7827717662, -0.8086757660}};
+
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                for (int v = 0; v < 256; ++v) {
+                    m_coeffs[i][j][v] =
+                        static_cast<qint32>(std::lround(s_lms[i][j] * toLinear(v / 255.0) * s_lmsMax));
+                }
+
+                // 255 is the scale of the packed components.
+                m_lab[i][j] = static_cast<qint32>(std::lround(s_lab[i][j] * 255.0 * (1 << s_labBits) / s_cbrtMax));
+            }
+        }
+
+        m_cbrt.resize(s_lmsMax + 1);
+
+        for (int v = 0; v <= s_lmsMax; ++v) {
+            m_cbrt[v] = static_cast<qint32>(std::lround(std::cbrt(static_cast<double>(v) / s_lmsMax) * s_cbrtMax));
+        }
+    }
+
+    //! \return Index of cone response in the cube root table.
+    int lms(int i,
+            int r,
+            int g,
+            int b) const
+    {
+        return qBound(0, m_coeffs[i][0][r] + m_coeffs[i][1][g] + m_coeffs[i][2][b], s_lmsMax);
+    }
+
+    static quint32 pack(int c0,
+                        int c1,
+                        int c2)
+    {
+        return (static_cast<quint32>(qBound(0, c0, 255)) << 16) | (static_cast<quint32>(qBound(0, c1, 255)) << 8)
+            | static_cast<quint32>(qBound(0, c2, 255));
+    }
+
+    static int clamp(double v)
+    {
+        return qBound(0, static_cast<int>(std::lround(v)), 255);
+    }
+
+    static double toLinear(double v)
+    {
+        return (v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+    }
+
+    static double toSrgb(double v)
+    {
+        v = qBound(0.0, v, 1.0);
+
+        return (v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055);
+    }
+
+private:
+    //! Fraction bits of YCbCr tables.
+    static constexpr int s_bits = 16;
+    static constexpr qint32 s_half = 1 << (s_bits - 1);
+    //! Scale of cone responses, it's the size of the cube root table.
+    static constexpr int s_lmsMax = (1 << 16) - 1;
+    //! Scale of cube roots.
+    static constexpr int s_cbrtMax = 1 << 12;
+    //! Fraction bits of Lab matrix.
+    static constexpr int s_labBits = 12;
+    static constexpr qint32 s_labHalf = 1 << (s_labBits - 1);
+
+    ColorSpace m_space;
+    //! Contributions of 8-bit components: YCbCr components or cone responses.
+    qint32 m_coeffs[3][3][256];
+    //! Fixed point matrix of cube roots of cone responses to Lab.
+    qint32 m_lab[3][3] = {};
+    std::vector<qint32> m_cbrt;
+}; // class ColorSpaceConverter
+
+//
+// K-means.
+//
+
+//! Minimum count of buckets assigned by one thread, every bucket is compared with the whole palette.
+const qsizetype s_minBucketsPerStripe = 1 << 12;
+
+//! Buffers of k-means, they are reused between palettes.
+struct KMeansScratch {
+    PaletteTable table;
+    //! Index of the nearest color of each bucket.
+    std::vector<uchar> assignment;
+    //! Sums of buckets by colors.
+    std::vector<ColorSums> sums;
+    //! Sums of stripes.
+    std::vector<std::vector<ColorSums>> partial;
+    ParallelTasks tasks;
+};
+
+//! Assign buckets to the nearest colors of the palette and sum them by colors.
+void assignBuckets(const std::vector<ColorBucket> &buckets,
+                   const PaletteTable &table,
+                   const QuantizeOptions &options,
+                   std::vector<uchar> &assignment,
+                   std::vector<ColorSums> &sums,
+                   std::vector<std::vector<ColorSums>> &partial,
+                   ParallelTasks &tasks)
+{
+    const auto nearest = kernels().nearest;
+    const int stripes = stripesCount(static_cast<qsizetype>(buckets.size()), s_minBucketsPerStripe, options);
+
+    // Integer sums, so the result doesn't depend on count of threads.
+    if (static_cast<int>(partial.size()) < stripes) {
+        partial.resize(stripes);
+    }
+
+    for (int i = 0; i < stripes; ++i) {
+        partial[i].assign(table.size, {});
+    }
+
+    parallelFor(static_cast<qsizetype>(buckets.size()),
+                stripes,
+                options,
+                tasks,
+                [&](int stripe, qsizetype first, qsizetype last) {
+                    auto &s = partial[stripe];
+
+                    for (qsizetype i = first; i < last; ++i) {
+                        const auto &b = buckets[i];
+                        const int idx = nearest(table, b.color);
+
+                        assignment[i] = static_cast<uchar>(idx);
+
+                        s[idx].red += redOf(b.color) * static_cast<quint64>(b.count);
+                        s[idx].green += greenOf(b.color) * static_cast<quint64>(b.count);
+                        s[idx].blue += blueOf(b.color) * static_cast<quint64>(b.count);
+                        s[idx].count += b.count;
+                    }
+                });
+
+    sums.assign(table.size, {});
+
+    for (int stripe = 0; stripe < stripes; ++stripe) {
+        const auto &p = partial[stripe];
+
+        for (int i = 0; i < table.size; ++i) {
+            sums[i].red += p[i].red;
+            sums[i].green += p[i].green;
+            sums[i].blue += p[i].blue;
+            sums[i].count += p[i].count;
+        }
+    }
+}
+
+//! Refine palette with k-means over buckets: colors move to means of buckets nearest to them.
+//! Stops after \a options.kmeansIterations iterations or when no color moves farther than
+//! \a options.kmeansThreshold. Buckets are mapped to the nearest colors of the refined palette.
+void refinePalette(const std::vector<ColorBucket> &buckets,
+                   const QuantizeOptions &options,
+                   KMeansScratch &scratch,
+                   QList<QRgb> &colors,
+                   InverseColorMap &inverse)
+{
+    if (colors.isEmpty()) {
+        return;
+    }
+
+    const qint64 threshold = qRound64(options.kmeansThreshold * options.kmeansThreshold);
+
+    auto &table = scratch.table;
+    auto &assignment = scratch.assignment;
+    auto &sums = scratch.sums;
+    assignment.resize(buckets.size());
+    bool converged = false;
+
+    for (int i = 0;; ++i) {
+        table.set(colors);
+        assignBuckets(buckets, table, options, assignment, sums, scratch.partial, scratch.tasks);
+
+        if (converged || i == options.kmeansIterations) {
+            break;
+        }
+
+        qint64 shift = 0;
+
+        for (qsizetype c = 0; c < colors.size(); ++c) {
+            // Colors without buckets stay in place.
+            if (sums[c].count) {
+                const auto half = sums[c].count / 2;
+                const QRgb color = qRgb(static_cast<int>((sums[c].red + half) / sums[c].count),
+                                        static_cast<int>((sums[c].green + half) / sums[c].count),
+                                        static_cast<int>((sums[c].blue + half) / sums[c].count));
+                const qint64 dr = qRed(color) - qRed(colors[c]);
+                const qint64 dg = qGreen(color) - qGreen(colors[c]);
+                const qint64 db = qBlue(color) - qBlue(colors[c]);
+
+                shift = qMax(shift, dr * dr + dg * dg + db * db);
+                colors[c] = color;
+            }
+        }
+
+        converged = (shift <= threshold);
+    }
+
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        inverse.value(buckets[i].color) = assignment[i];
+    }
+}
+
+//! Palette with all colors of buckets, ordered by color to not depend on buckets order.
+void exactPalette(std::vector<ColorBucket> &buckets,
+                  QList<QRgb> &colors,
+                  InverseColorMap &inverse)
+{
+    std::sort(buckets.begin(), buckets.end(), [](const ColorBucket &l, const ColorBucket &r) {
+        return l.color < r.color;
+    });
+
+    for (const auto &b : std::as_const(buckets)) {
+        inverse.value(b.color) = static_cast<unsigned char>(colors.size());
+        colors.push_back(qRgb(redOf(b.color), greenOf(b.color), blueOf(b.color)));
+    }
+}
+
+//! Engines and buffers of building palettes, they are reused between palettes.
+struct PaletteScratch {
+    MedianCutScratch medianCut;
+    WuQuantizer wu;
+    Octree octree;
+    KMeansScratch kmeans;
+    //! Buckets in the perceptual color space.
+    std::vector<ColorBucket> converted;
+    //! Counts of converted colors, several colors may be converted to the same one.
+    ColorHash<quint64> convertedCounts;
+    QList<QRgb> convertedColors;
+    InverseColorMap convertedInverse;
+};
+
+//! Build palette with the selected engine and refine it.
+void enginePalette(std::vector<ColorBucket> &buckets,
+                   long long int k,
+                   const QuantizeOptions &options,
+                   const SideWeights &weights,
+                   PaletteScratch &scratch,
+                   QList<QRgb> &colors,
+                   InverseColorMap &inverse)
+{
+    switch (options.quantizer) {
+    case Quantizer::Wu:
+        scratch.wu.palette(buckets, k, colors, inverse);
+        break;
+
+    case Quantizer::Octree:
+        scratch.octree.reset(k);
+        scratch.octree.palette(buckets, colors, inverse);
+        break;
+
+    default:
+        medianCutPalette(buckets, k, weights, options, scratch.medianCut, colors, inverse);
+        break;
+    }
+
+    if (options.kmeansIterations > 0) {
+        refinePalette(buckets, options, scratch.kmeans, colors, inverse);
+    }
+}
+
+//! Build palette in the perceptual color space, colors of the palette are converted back to RGB.
+void perceptualPalette(const std::vector<ColorBucket> &buckets,
+                       long long int k,
+                       const QuantizeOptions &options,
+                       PaletteScratch &scratch,
+                       QList<QRgb> &colors,
+                       InverseColorMap &inverse)
+{
+    const auto &converter = ColorSpaceConverter::instance(options.colorSpace);
+
+    auto &counts = scratch.convertedCounts;
+    counts.reset(static_cast<qsizetype>(buckets.size()));
+
+    for (const auto &b : buckets) {
+        counts.value(converter.to(b.color)) += b.count;
+    }
+
+    // Merged buckets are ordered by color, so the palette doesn't depend on order of buckets.
+    auto &converted = scratch.converted;
+    converted.clear();
+
+    const quint64 maxCount = std::numeric_limits<quint32>::max();
+
+    for (size_t i = 0; i < counts.keys().size(); ++i) {
+        if (counts.keys()[i] != ColorHash<quint64>::s_empty) {
+            converted.push_back({counts.keys()[i], static_cast<quint32>(qMin(counts.values()[i], maxCount))});
+        }
+    }
+
+    std::sort(converted.begin(), converted.end(), [](const ColorBucket &l, const ColorBucket &r) {
+        return l.color < r.color;
+    });
+
+    auto &convertedColors = scratch.convertedColors;
+    auto &convertedInverse = scratch.convertedInverse;
+    convertedColors.clear();
+    convertedInverse.reset(static_cast<qsizetype>(converted.size()));
+
+    enginePalette(converted, k, options, s_uniformWeights, scratch, convertedColors, convertedInverse);
+
+    for (const auto &c : std::as_const(convertedColors)) {
+        colors.push_back(converter.from(c));
+    }
+
+    for (const auto &b : buckets) {
+        if (const auto *idx = convertedInverse.find(converter.to(b.color))) {
+            inverse.value(b.color) = *idx;
+        }
+    }
+}
+
+//! Build palette of at most \a k colors and the inverse map for the buckets.
+void buildPalette(std::vector<ColorBucket> &buckets,
+                  long long int k,
+                  const QuantizeOptions &options,
+                  PaletteScratch &scratch,
+                  QList<QRgb> &colors,
+                  InverseColorMap &inverse)
+{
+    if (static_cast<long long int>(buckets.size()) <= k) {
+        exactPalette(buckets, colors, inverse);
+    } else if (options.colorSpace != ColorSpace::RGB) {
+        perceptualPalette(buckets, k, options, scratch, colors, inverse);
+    } else {
+        enginePalette(buckets, k, options, s_rgbWeights, scratch, colors, inverse);
+    }
+}
+
+//! Palette with the inverse color map.
+struct Palette {
+    QList<QRgb> colors;
+    InverseColorMap inverse;
+    PaletteTable table;
+    //! Nearest colors of colors missed in the inverse map.
+    NearestColorGrid grid;
+    //! All colors of the histogram are in the palette, dithering is not needed.
+    bool exact = false;
+    //! Index of transparent color, it's not in the table, or -1.
+    int transparent = -1;
+};
+
+//! \return Bits per pixel of the smallest color map with \a count colors, GIF needs at least 1 bit.
+int colorMapBits(qsizetype count)
+{
+    int bits = 1;
+
+    while ((1 << bits) < count) {
+        ++bits;
+    }
+
+    return bits;
+}
+
+//! Add transparent color to the end of the palette if \a transparent.
+void setTransparent(Palette &palette,
+                    bool transparent)
+{
+    if (transparent) {
+        palette.transparent = static_cast<int>(palette.colors.size());
+        palette.inverse.value(s_transparentKey) = static_cast<unsigned char>(palette.transparent);
+        palette.colors.push_back(qRgba(0, 0, 0, 0));
+    } else {
+        palette.transparent = -1;
+    }
+}
+
+//! Palette of the given colors, pixels are mapped to the nearest ones. Transparent color is added
+//! if \a transparent and there is a free slot.
+void fixedPalette(const QList<QRgb> &colors,
+                  bool transparent,
+                  Palette &palette)
+{
+    palette.colors = colors.mid(0, 256);
+    palette.inverse.reset(palette.colors.size() + 1);
+    palette.exact = false;
+
+    // Colors of the palette are found without search, the first one on duplicates.
+    for (qsizetype i = palette.colors.size() - 1; i >= 0; --i) {
+        palette.colors[i] |= 0xFF000000u;
+        palette.inverse.value(packedColor(palette.colors[i])) = static_cast<unsigned char>(i);
+    }
+
+    palette.table.set(palette.colors);
+    palette.grid.reset();
+
+    setTransparent(palette, transparent && palette.colors.size() < 256);
+}
+
+//! \return Image in the format processed by the quantizer, that is Indexed8, RGB32 or ARGB32 if there is alpha.
+QImage quantizable(const QImage &img)
+{
+    if (img.format() == QImage::Format_Indexed8 || img.format() == QImage::Format_RGB32
+        || img.format() == QImage::Format_ARGB32) {
+        return img;
+    } else {
+        return img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+}
+
+//! Fill buckets with colors of the histogram. Counts are scaled down if they don't fit 32 bits.
+//! \return Are there transparent pixels, they don't go to buckets.
+template<typename T>
+bool bucketsOf(const ColorHash<T> &histogram,
+               std::vector<ColorBucket> &buckets)
+{
+    T max = 0;
+
+    for (size_t i = 0; i < histogram.keys().size(); ++i) {
+        if (histogram.keys()[i] != ColorHash<T>::s_empty) {
+            max = qMax(max, histogram.values()[i]);
+        }
+    }
+
+    int shift = 0;
+
+    while ((static_cast<quint64>(max) >> shift) > std::numeric_limits<quint32>::max()) {
+        ++shift;
+    }
+
+    buckets.clear();
+    buckets.reserve(histogram.size());
+
+    bool transparent = false;
+
+    for (size_t i = 0; i < histogram.keys().size(); ++i) {
+        // Colors that left frames of FramesHistogram have zero counts.
+        if (histogram.keys()[i] == ColorHash<T>::s_empty || !histogram.values()[i]) {
+            continue;
+        }
+
+        if (histogram.keys()[i] == s_transparentKey) {
+            transparent = true;
+        } else {
+            buckets.push_back(
+                {histogram.keys()[i],
+                 qMax(static_cast<quint32>(static_cast<quint64>(histogram.values()[i]) >> shift), 1u)});
+        }
+    }
+
+    return transparent;
+}
+
+//! Build palette of \a k colors from buckets. If \a transparent the last slot is reserved
+//! for transparent pixels.
+void makePalette(std::vector<ColorBucket> &buckets,
+                 long long int k,
+                 bool transparent,
+                 const QuantizeOptions &options,
+                 PaletteScratch &scratch,
+                 Palette &palette)
+{
+    const long long int opaque = (transparent ? k - 1 : k);
+
+    palette.colors.clear();
+    palette.inverse.reset(static_cast<qsizetype>(buckets.size()) + 1);
+
+    palette.exact = (static_cast<long long int>(buckets.size()) <= opaque);
+
+    buildPalette(buckets, opaque, options, scratch, palette.colors, palette.inverse);
+
+    palette.table.set(palette.colors);
+    palette.grid.reset();
+
+    setTransparent(palette, transparent);
+}
+
+//! Offsets of ordered dithering with 8x8 Bayer matrix.
+struct BayerTable {
+    alignas(32) quint32 add[8][8];
+    alignas(32) quint32 sub[8][8];
+
+    //! Offsets are spread by half of the distance between colors of the evenly distributed palette
+    //! of \a size colors, median cut places colors more densely. \a origin aligns the matrix with the frame.
+    BayerTable(qsizetype size,
+               const QPoint &origin)
+    {
+        static const int s_matrix[8][8] = {{0, 32, 8, 40, 2, 34, 10, 42},
+                                           {48, 16, 56, 24, 50, 18, 58, 26},
+                                           {12, 44, 4, 36, 14, 46, 6, 38},
+                                           {60, 28, 52, 20, 62, 30, 54, 22},
+                                           {3, 35, 11, 43, 1, 33, 9, 41},
+                                           {51, 19, 59, 27, 49, 17, 57, 25},
+                                           {15, 47, 7, 39, 13, 45, 5, 37},
+                                           {63, 31, 55, 23, 61, 29, 53, 21}};
+
+        const double spread = 128.0 / std::cbrt(static_cast<double>(qMax(size, static_cast<qsizetype>(2))));
+
+        for (int y = 0; y < 8; ++y) {
+            for (int x = 0; x < 8; ++x) {
+                const int m = s_matrix[(y + origin.y()) & 7][(x + origin.x()) & 7];
+                const int offset = qRound(((m + 0.5) / 64.0 - 0.5) * spread);
+                const quint32 v = static_cast<quint32>(qAbs(offset)) * 0x00010101u;
+
+                add[y][x] = (offset > 0 ? v : 0);
+                sub[y][x] = (offset < 0 ? v : 0);
+            }
+        }
+    }
+};
+
+//! Set index of fully transparent pixels of the line of 32-bit pixels to \a transparent.
+inline void maskTransparent(const QRgb *line,
+                            int width,
+                            int transparent,
+                            uchar *indices)
+{
+    for (int x = 0; x < width; ++x) {
+        if (qAlpha(line[x]) == 0) {
+            indices[x] = static_cast<uchar>(transparent);
+        }
+    }
+}
+
+//! Buffers of mapping pixels to the palette, they are reused between images.
+struct MappingScratch {
+    //! Ring of rows of errors of Floyd-Steinberg dithering.
+    std::vector<int> errors;
+    //! Progress of rows of the ring, row * (width + 1) + count of done pixels.
+    std::unique_ptr<std::atomic<qint64>[]> progress;
+    int progressSize = 0;
+    //! Dithered line of each stripe.
+    std::vector<std::vector<QRgb>> lines;
+    //! Cache of the nearest colors of each stripe.
+    std::vector<NearestCache> caches;
+    ParallelTasks tasks;
+
+    //! Prepare empty caches for \a stripes stripes.
+    void resetCaches(int stripes)
+    {
+        if (static_cast<int>(caches.size()) < stripes) {
+            caches.resize(stripes);
+        }
+
+        for (int i = 0; i < stripes; ++i) {
+            caches[i].reset();
+        }
+    }
+
+    //! \return Search in the palette with the cache of the stripe.
+    NearestSearch search(const Palette &palette,
+                         int stripe)
+    {
+        return {palette.inverse, palette.table, palette.grid, &caches[stripe], kernels().nearest};
+    }
+};
+
+//! Count of pixels of Floyd-Steinberg row published at once.
+const int s_ditherChunk = 64;
+
+//! Map 32-bit image to indices in the palette with Floyd-Steinberg error diffusion.
+//! Rows are pipelined: a pixel needs errors of three pixels above it, so a row is processed
+//! while the previous one is at least two pixels ahead. Workers take rows in order, every row
+//! waits only for rows taken before it, so the calling thread alone finishes the image if
+//! tasks don't start. Errors are summed as integers, so result doesn't depend on threads.
+void mapImageFloydSteinberg(const QImage &src,
+                            const Palette &palette,
+                            uchar *indices,
+                            qsizetype bytesPerLine,
+                            const QuantizeOptions &options,
+                            MappingScratch &scratch)
+{
+    const int width = src.width();
+    const int height = src.height();
+    const bool alpha = (palette.transparent >= 0 && src.format() == QImage::Format_ARGB32);
+    const int workers = stripesCount(height, s_minPixelsPerStripe / width, options);
+    // Rows in work are the last taken ones, rows before them are done.
+    const int ring = workers + 2;
+    // Errors multiplied by 16 for 3 channels, with one pixel margin on each side.
+    const qsizetype rowSize = (static_cast<qsizetype>(width) + 2) * 3;
+
+    scratch.errors.assign(rowSize * ring, 0);
+
+    if (scratch.progressSize < ring) {
+        scratch.progress = std::make_unique<std::atomic<qint64>[]>(ring);
+        scratch.progressSize = ring;
+    }
+
+    for (int i = 0; i < ring; ++i) {
+        scratch.progress[i].store(-1, std::memory_order_relaxed);
+    }
+
+    scratch.resetCaches(workers);
+
+    std::atomic<int> nextRow = {0};
+    const qint64 rowStep = static_cast<qint64>(width) + 1;
+
+    parallelFor(workers, workers, options, scratch.tasks, [&](int stripe, qsizetype, qsizetype) {
+        auto search = scratch.search(palette, stripe);
+
+        for (int y = nextRow.fetch_add(1); y < height; y = nextRow.fetch_add(1)) {
+            const auto *line = reinterpret_cast<const QRgb *>(src.constScanLine(y));
+            uchar *out = indices + y * bytesPerLine;
+            const int *above = scratch.errors.data() + (y % ring) * rowSize;
+            int *below = scratch.errors.data() + ((y + 1) % ring) * rowSize;
+            auto &previous = scratch.progress[(y + ring - 1) % ring];
+            auto &own = scratch.progress[y % ring];
+            // Error diffused to the right.
+            int right[3] = {0, 0, 0};
+
+            // The row below was used by a row that is done.
+            std::fill_n(below, rowSize, 0);
+
+            for (int chunk = 0; chunk < width; chunk += s_ditherChunk) {
+                const int end = qMin(chunk + s_ditherChunk, width);
+
+                if (y > 0) {
+                    const qint64 needed = (y - 1) * rowStep + qMin(end + 1, width);
+
+                    while (previous.load(std::memory_order_acquire) < needed) {
+                        std::this_thread::yield();
+                    }
+                }
+
+                for (int x = chunk; x < end; ++x) {
+                    // Transparent pixels don't take part in diffusion.
+                    if (alpha && qAlpha(line[x]) == 0) {
+                        out[x] = static_cast<uchar>(palette.transparent);
+                        right[0] = right[1] = right[2] = 0;
+
+                        continue;
+                    }
+
+                    const int *e = above + (x + 1) * 3;
+                    const int r = qBound(0, qRed(line[x]) + (e[0] + right[0]) / 16, 255);
+                    const int g = qBound(0, qGreen(line[x]) + (e[1] + right[1]) / 16, 255);
+                    const int b = qBound(0, qBlue(line[x]) + (e[2] + right[2]) / 16, 255);
+
+                    const uchar idx = lookupIndex(static_cast<quint32>((r << 16) | (g << 8) | b), search);
+                    out[x] = idx;
+
+                    const int error[3] = {r - palette.table.red[idx],
+                                          g - palette.table.green[idx],
+                                          b - palette.table.blue[idx]};
+
+                    for (int c = 0; c < 3; ++c) {
+                        right[c] = error[c] * 7;
+                        below[x * 3 + c] += error[c] * 3;
+                        below[(x + 1) * 3 + c] += error[c] * 5;
+                        below[(x + 2) * 3 + c] += error[c];
+                    }
+                }
+
+                own.store(y * rowStep + end, std::memory_order_release);
+            }
+        }
+    });
+}
+
+//! Map image to indices in the palette. \a origin is the position of the image in the frame,
+//! it aligns ordered dithering.
+void mapImage(const QImage &src,
+              const Palette &palette,
+              uchar *indices,
+              qsizetype bytesPerLine,
+              const QuantizeOptions &options,
+              MappingScratch &scratch,
+              const QPoint &origin = {})
+{
+    if (options.dithering != Dithering::None && !palette.exact) {
+        const QImage rgb = (src.format() == QImage::Format_Indexed8 ? quantizable(src.convertToFormat(
+                                                                          QImage::Format_ARGB32))
+                                                                    : src);
+        const bool alpha = (palette.transparent >= 0 && rgb.format() == QImage::Format_ARGB32);
+
+        if (options.dithering == Dithering::FloydSteinberg) {
+            mapImageFloydSteinberg(rgb, palette, indices, bytesPerLine, options, scratch);
+
+            return;
+        }
+
+        const BayerTable bayer(palette.colors.size(), origin);
+        const auto ditherLine = kernels().ditherLine;
+        const auto mapLine = kernels().mapLine;
+        const int stripes = stripesCount(rgb.height(), s_minPixelsPerStripe / rgb.width(), options);
+
+        if (static_cast<int>(scratch.lines.size()) < stripes) {
+            scratch.lines.resize(stripes);
+        }
+
+        for (int i = 0; i < stripes; ++i) {
+            scratch.lines[i].resize(rgb.width());
+        }
+
+        // Dithered colors are mostly missed in the inverse map.
+        scratch.resetCaches(stripes);
+
+        parallelFor(rgb.height(),
+                    stripes,
+                    options,
+                    scratch.tasks,
+                    [&](int stripe, qsizetype first, qsizetype last) {
+                        auto &dithered = scratch.lines[stripe];
+                        auto search = scratch.search(palette, stripe);
+
+                        for (qsizetype y = first; y < last; ++y) {
+                            ditherLine(reinterpret_cast<const QRgb *>(rgb.constScanLine(y)),
+                                       rgb.width(),
+                                       bayer.add[y & 7],
+                                       bayer.sub[y & 7],
+                                       dithered.data());
+                            mapLine(dithered.data(), rgb.width(), search, indices + y * bytesPerLine);
+
+                            if (alpha) {
+                                maskTransparent(dithered.data(),
+                                                rgb.width(),
+                                                palette.transparent,
+                                                indices + y * bytesPerLine);
+                            }
+                        }
+                    });
+
+        return;
+    }
+
+    if (src.format() == QImage::Format_Indexed8) {
+        // Colors of the table are looked up once.
+        uchar lut[256] = {};
+        const auto table = src.colorTable();
+        NearestSearch search = {palette.inverse, palette.table, palette.grid, nullptr, kernels().nearest};
+
+        for (qsizetype i = 0; i < table.size(); ++i) {
+            lut[i] = (palette.transparent >= 0 && qAlpha(table[i]) == 0
+                          ? static_cast<uchar>(palette.transparent)
+                          : lookupIndex(packedColor(table[i]), search));
+        }
+
+        parallelFor(src.height(),
+                    stripesCount(src.height(), s_minPixelsPerStripe / src.width(), options),
+                    options,
+                    scratch.tasks,
+                    [&](int, qsizetype first, qsizetype last) {
+                        for (qsizetype y = first; y < last; ++y) {
+                            const uchar *line = src.constScanLine(y);
+                            uchar *out = indices + y * bytesPerLine;
+
+                            for (int x = 0; x < src.width(); ++x) {
+                                out[x] = lut[line[x]];
+                            }
+                        }
+                    });
+
+        return;
+    }
+
+    const auto mapLine = kernels().mapLine;
+    const bool alpha = (palette.transparent >= 0 && src.format() == QImage::Format_ARGB32);
+    const int stripes = stripesCount(src.height(), s_minPixelsPerStripe / src.width(), options);
+
+    scratch.resetCaches(stripes);
+
+    parallelFor(src.height(),
+                stripes,
+                options,
+                scratch.tasks,
+                [&](int stripe, qsizetype first, qsizetype last) {
+                    auto search = scratch.search(palette, stripe);
+
+                    for (qsizetype y = first; y < last; ++y) {
+                        const auto *line = reinterpret_cast<const QRgb *>(src.constScanLine(y));
+
+                        mapLine(line, src.width(), search, indices + y * bytesPerLine);
+
+                        if (alpha) {
+                            maskTransparent(line, src.width(), palette.transparent, indices + y * bytesPerLine);
+                        }
+                    }
+                });
+}
+
+//! Build palette of \a k colors from the histogram, one of them is transparent if there are
+//! transparent pixels or \a transparent is true.
+void paletteOf(const ColorHistogram &histogram,
+               long long int k,
+               bool transparent,
+               const QuantizeOptions &options,
+               std::vector<ColorBucket> &buckets,
+               PaletteScratch &scratch,
+               Palette &palette)
+{
+    transparent = bucketsOf(histogram, buckets) || transparent;
+
+    makePalette(buckets, k, transparent, options, scratch, palette);
+}
+
+//! \return Is mean squared distance between pixels counted in the histogram and their colors
+//! in the palette not greater than \a maxError.
+bool paletteFits(const ColorHistogram &histogram,
+                 const Palette &palette,
+                 double maxError)
+{
+    NearestSearch search = {palette.inverse, palette.table, palette.grid, nullptr, kernels().nearest};
+
+    quint64 pixels = 0;
+
+    for (size_t i = 0; i < histogram.keys().size(); ++i) {
+        if (histogram.keys()[i] != ColorHistogram::s_empty) {
+            pixels += histogram.values()[i];
+        }
+    }
+
+    const double bound = maxError * static_cast<double>(pixels);
+    double error = 0.0;
+
+    for (size_t i = 0; i < histogram.keys().size(); ++i) {
+        const auto color = histogram.keys()[i];
+
+        if (color == s_transparentKey) {
+            if (palette.transparent < 0) {
+                return false;
+            }
+        } else if (color != ColorHistogram::s_empty) {
+            const auto idx = lookupIndex(color, search);
+            const qint32 dr = palette.table.red[idx] - redOf(color);
+            const qint32 dg = palette.table.green[idx] - greenOf(color);
+            const qint32 db = palette.table.blue[idx] - blueOf(color);
+
+            error += static_cast<double>(dr * dr + dg * dg + db * db) * histogram.values()[i];
+
+            if (error > bound) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+} /* namespace anonymous */
+
+SimdLevel simdLevel()
+{
+    return qMin(supportedSimdLevel(), s_maxSimdLevel.load());
+}
+
+void setMaxSimdLevel(SimdLevel level)
+{
+    s_maxSimdLevel = level;
+}
+
+QList<QRgb> grayscalePalette(int count)
+{
+    count = qBound(2, count, 256);
+
+    QList<QRgb> colors;
+    colors.reserve(count);
+
+    for (int i = 0; i < count; ++i) {
+        const int v = (i * 255 + (count - 1) / 2) / (count - 1);
+        colors.push_back(qRgb(v, v, v));
+    }
+
+    return colors;
+}
+
+QList<QRgb> webSafePalette()
+{
+    QList<QRgb> colors;
+    colors.reserve(216);
+
+    for (int r = 0; r < 6; ++r) {
+        for (int g = 0; g < 6; ++g) {
+            for (int b = 0; b < 6; ++b) {
+                colors.push_back(qRgb(r * 51, g * 51, b * 51));
+            }
+        }
+    }
+
+    return colors;
+}
+
+//
+// QuantizerContextData
+//
+
+//! Buffers of QuantizerContext.
+struct QuantizerContextData {
+    ColorHistogram histogram;
+    //! Histograms of stripes.
+    std::vector<ColorHistogram> partial;
+    ParallelTasks tasks;
+    //! Counts of colors of all frames for the global palette.
+    ColorHash<quint64> total;
+    std::vector<ColorBucket> buckets;
+    PaletteScratch paletteScratch;
+    MappingScratch mapping;
+    //! Palette of quantizeImageToKColors().
+    Palette palette;
+    //! Palette of the screen color map.
+    Palette screen;
+    //! The last palette built for a local color map.
+    Palette previous;
+    //! Indices of pixels of the frame.
+    std::vector<GifPixelType> pixels;
+    //! Local color map of the frame.
+    ColorMapObject colorMap = {};
+    GifColorType colors[256] = {};
+}; // struct QuantizerContextData
+
+//
+// QuantizerContext
+//
+
+QuantizerContext::QuantizerContext() = default;
+
+QuantizerContext::~QuantizerContext() = default;
+
+void QuantizerContext::clear()
+{
+    m_data.reset();
+}
+
+QuantizerContextData &QuantizerContext::data()
+{
+    if (!m_data) {
+        m_data = std::make_unique<QuantizerContextData>();
+    }
+
+    return *m_data;
+}
+
+QImage quantizeImageToKColors(const QImage &img,
+                              long long int k,
+                              const QuantizeOptions &options)
+{
+    QuantizerContext context;
+
+    return quantizeImageToKColors(img, k, options, context);
+}
+
+QImage quantizeImageToKColors(const QImage &img,
+                              long long int k,
+                              const QuantizeOptions &options,
+                              QuantizerContext &context)
+{
+    if (k < 2 || img.isNull()) {
+        return QImage();
+    }
+
+    // Indexed8 can't hold more.
+    k = qMin(k, 256ll);
+
+    const QImage src = quantizable(img);
+    auto &d = context.data();
+
+    // collect colors and count them
+    collectColors(src, d.histogram, d.partial, d.tasks, options);
+
+    paletteOf(d.histogram, k, false, options, d.buckets, d.paletteScratch, d.palette);
+
+    QImage res(img.size(), QImage::Format_Indexed8);
+    res.setColorTable(d.palette.colors);
+
+    mapImage(src, d.palette, res.bits(), res.bytesPerLine(), options, d.mapping);
+
+    return res;
+}
+
+namespace /* anonymous */
+{
+
+//! Read function of giflib, user data of the handle is QFile.
+int readFile(GifFileType *handle,
+             GifByteType *data,
+             int size)
+{
+    return static_cast<int>(static_cast<QFile *>(handle->UserData)->read(reinterpret_cast<char *>(data), size));
+}
+
+//! \return Does the image read by DGifGetImageDesc() fit the screen.
+bool isValidImage(const GifFileType *handle)
+{
+    const int topRow = handle->Image.Top;
+    const int leftCol = handle->Image.Left;
+    const int width = handle->Image.Width;
+    const int height = handle->Image.Height;
+
+    return (width > 0
+            && height > 0
+            && width <= (INT_MAX / height)
+            && leftCol + width <= handle->SWidth
+            && topRow + height <= handle->SHeight
+            && (handle->Image.ColorMap || handle->SColorMap));
+}
+
+//! Read pixels of the image read by DGifGetImageDesc() into Indexed8 \a img with colors of the image
+//! or of the screen. \return false on error.
+bool readImage(GifFileType *handle,
+               int transparentIndex,
+               QImage &img)
+{
+    const int width = handle->Image.Width;
+    const int height = handle->Image.Height;
+
+    img = QImage(width, height, QImage::Format_Indexed8);
+    img.fill(handle->SBackGroundColor);
+
+    if (handle->Image.Interlace) {
+        int InterlacedOffset[] = {0, 4, 2, 1};
+        int InterlacedJumps[] = {8, 8, 4, 2};
+
+        for (int i = 0; i < 4; ++i) {
+            for (int row = InterlacedOffset[i]; row < height; row += InterlacedJumps[i]) {
+                if (DGifGetLine(handle, img.scanLine(row), width) == GIF_ERROR) {
+                    return false;
+                }
+            }
+        }
+    } else {
+        for (int row = 0; row < height; ++row) {
+            if (DGifGetLine(handle, img.scanLine(row), width) == GIF_ERROR) {
+                return false;
+            }
+        }
+    }
+
+    const ColorMapObject *cm = (handle->Image.ColorMap ? handle->Image.ColorMap : handle->SColorMap);
+
+    img.setColorCount(cm->ColorCount);
+
+    for (int i = 0; i < cm->ColorCount; ++i) {
+        GifColorType gifColor = cm->Colors[i];
+        QRgb color = gifColor.Blue | (gifColor.Green << 8) | (gifColor.Red << 16);
+
+        if (i != transparentIndex) {
+            color |= (0xFF << 24);
+        }
+
+        img.setColor(i, color);
+    }
+
+    return true;
+}
+
+//! Values of extensions that apply to the following images.
+struct Extensions {
+    int delay = -1;
+    int disposal = -1;
+    int transparent = -1;
+    //! Loop count of NETSCAPE2.0 application extension.
+    int loopCount = -1;
+}; // struct Extensions
+
+//! Read extension record into \a ext. \return false on error.
+bool readExtension(GifFileType *handle,
+                   Extensions &ext)
+{
+    GifByteType *extData;
+    int extFunction;
+
+    if (DGifGetExtension(handle, &extFunction, &extData) == GIF_ERROR) {
+        return false;
+    }
+
+    bool netscape = false;
+
+    while (extData != NULL) {
+        switch (extFunction) {
+        case GRAPHICS_EXT_FUNC_CODE: {
+            GraphicsControlBlock b;
+            DGifExtensionToGCB(extData[0], extData + 1, &b);
+            ext.delay = b.DelayTime * 10;
+            ext.disposal = b.DisposalMode;
+            ext.transparent = b.TransparentColor;
+        } break;
+
+        case APPLICATION_EXT_FUNC_CODE: {
+            // Loop sub-block follows the application identifier.
+            if (netscape && extData[0] >= 3 && extData[1] == 1) {
+                ext.loopCount = extData[2] | (extData[3] << 8);
+            }
+
+            netscape = (extData[0] == 11
+                        && (!std::memcmp(extData + 1, "NETSCAPE2.0", 11)
+                            || !std::memcmp(extData + 1, "ANIMEXTS1.0", 11)));
+        } break;
+
+        default:
+            break;
+        }
+
+        if (DGifGetExtensionNext(handle, &extData) == GIF_ERROR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//! Skip LZW data of the image read by DGifGetImageDesc() without decompression. \return false on error.
+bool skipImage(GifFileType *handle)
+{
+    int codeSize = 0;
+    GifByteType *block = nullptr;
+
+    if (DGifGetCode(handle, &codeSize, &block) == GIF_ERROR) {
+        return false;
+    }
+
+    while (block) {
+        if (DGifGetCodeNext(handle, &block) == GIF_ERROR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//! Draw \a img at \a pos over \a canvas, the first frame becomes the canvas.
+//! \return Composed frame, \a canvas becomes the canvas of the next frame after disposal.
+QImage composeFrame(QImage &canvas,
+                    QImage img,
+                    const QPoint &pos,
+                    int disposal)
+{
+    const QRect r(pos, img.size());
+
+    if (canvas.isNull()) {
+        img.convertTo(QImage::Format_ARGB32);
+        canvas = img;
+    } else {
+        QImage tmp = canvas;
+
+        {
+            QPainter p(&tmp);
+            p.drawImage(pos.x(), pos.y(), img);
+        }
+
+        img = tmp;
+
+        if (disposal != DISPOSE_PREVIOUS) {
+            canvas = img;
+        }
+    }
+
+    // Background is transparent.
+    if (disposal == DISPOSE_BACKGROUND) {
+        QPainter p(&canvas);
+        p.setCompositionMode(QPainter::CompositionMode_Clear);
+        p.fillRect(r, Qt::transparent);
+    }
+
+    return img;
+}
+
+} /* namespace anonymous */
+
+//
+// FrameCache
+//
+
+//! LRU cache of decoded frames, it's shared by Gif::at() and prefetch in the thread pool.
+//! Keyframes of FrameStorage::Lazy are cached with their canvases.
+struct FrameCache {
+    struct Entry {
+        QImage image;
+        //! Screen after disposal of the keyframe.
+        QImage canvas;
+        //! Neighbours in the list of cached frames, the most recently used is the first.
+        qsizetype prev = -1;
+        qsizetype next = -1;
+        //! The frame is being decoded by prefetch.
+        bool loading = false;
+    };
+
+    //! \return Is the frame in the cache, it becomes the most recently used. Waits for the frame if it's
+    //! being prefetched.
+    bool find(qsizetype idx,
+              QImage &img)
+    {
+        QMutexLocker lock(&mutex);
+
+        // Entries may be reallocated while waiting.
+        while (entry(idx).loading) {
+            loaded.wait(&mutex);
+        }
+
+        const auto &e = entries[idx];
+
+        if (e.image.isNull()) {
+            ++stats.misses;
+
+            return false;
+        }
+
+        unlink(idx);
+        linkFirst(idx);
+
+        ++stats.hits;
+        img = e.image;
+
+        return true;
+    }
+
+    //! Put the frame to the cache.
+    void insert(qsizetype idx,
+                const QImage &img)
+    {
+        QMutexLocker lock(&mutex);
+
+        insertLocked(idx, img, QImage());
+    }
+
+    //! \return Is the keyframe with its canvas in the cache, it becomes the most recently used.
+    bool findKeyframe(qsizetype idx,
+                      QImage &img,
+                      QImage &canvas)
+    {
+        QMutexLocker lock(&mutex);
+
+        const auto &e = entry(idx);
+
+        if (e.canvas.isNull()) {
+            return false;
+        }
+
+        unlink(idx);
+        linkFirst(idx);
+
+        img = e.image;
+        canvas = e.canvas;
+
+        return true;
+    }
+
+    //! Put the keyframe with its canvas to the cache, it replaces the cached frame.
+    void insertKeyframe(qsizetype idx,
+                        const QImage &img,
+                        const QImage &canvas)
+    {
+        QMutexLocker lock(&mutex);
+
+        insertLocked(idx, img, canvas);
+    }
+
+    //! \return Should the frame be prefetched, it's marked as loading then. Cached frame becomes
+    //! the most recently used, it will be requested soon.
+    bool beginLoad(qsizetype idx)
+    {
+        QMutexLocker lock(&mutex);
+
+        auto &e = entry(idx);
+
+        if (!e.image.isNull()) {
+            unlink(idx);
+            linkFirst(idx);
+
+            return false;
+        }
+
+        if (e.loading) {
+            return false;
+        }
+
+        e.loading = true;
+
+        return true;
+    }
+
+    //! Put the prefetched frame to the cache.
+    void endLoad(qsizetype idx,
+                 const QImage &img)
+    {
+        QMutexLocker lock(&mutex);
+
+        entry(idx).loading = false;
+        insertLocked(idx, img, QImage());
+        ++stats.prefetched;
+
+        loaded.wakeAll();
+    }
+
+    //! \return Should prefetch be started, only one runs at once.
+    bool beginPrefetch()
+    {
+        QMutexLocker lock(&mutex);
+
+        if (prefetching || budget <= 0 || prefetchCount <= 0) {
+            return false;
+        }
+
+        prefetching = true;
+
+        return true;
+    }
+
+    void endPrefetch()
+    {
+        QMutexLocker lock(&mutex);
+
+        prefetching = false;
+
+        prefetched.wakeAll();
+    }
+
+    //! Set budget in bytes, frames that don't fit it are evicted.
+    void setBudget(qint64 bytes)
+    {
+        QMutexLocker lock(&mutex);
+
+        budget = qMax(bytes, static_cast<qint64>(0));
+
+        evict(0);
+    }
+
+    //! Wait for prefetch and remove all frames.
+    void clear()
+    {
+        QMutexLocker lock(&mutex);
+
+        while (prefetching) {
+            prefetched.wait(&mutex);
+        }
+
+        entries.clear();
+        first = -1;
+        last = -1;
+        stats = {};
+    }
+
+private:
+    Entry &entry(qsizetype idx)
+    {
+        if (static_cast<qsizetype>(entries.size()) <= idx) {
+            entries.resize(idx + 1);
+        }
+
+        return entries[idx];
+    }
+
+    //! Put the frame, keyframe has not null \a canvas.
+    void insertLocked(qsizetype idx,
+                      const QImage &img,
+                      const QImage &canvas)
+    {
+        auto &e = entry(idx);
+        const qint64 size = img.sizeInBytes() + canvas.sizeInBytes();
+
+        if (!e.image.isNull() && (canvas.isNull() || !e.canvas.isNull())) {
+            return;
+        }
+
+        if (img.isNull() || size > budget) {
+            return;
+        }
+
+        if (!e.image.isNull()) {
+            remove(idx);
+        }
+
+        evict(size);
+
+        e.image = img;
+        e.canvas = canvas;
+        stats.bytes += size;
+        linkFirst(idx);
+    }
+
+    //! Remove the cached frame.
+    void remove(qsizetype idx)
+    {
+        auto &e = entries[idx];
+
+        unlink(idx);
+
+        stats.bytes -= e.image.sizeInBytes() + e.canvas.sizeInBytes();
+        e.image = QImage();
+        e.canvas = QImage();
+    }
+
+    //! Evict the least recently used frames until \a size bytes fit the budget.
+    void evict(qint64 size)
+    {
+        while (last != -1 && stats.bytes + size > budget) {
+            remove(last);
+
+            ++stats.evictions;
+        }
+    }
+
+    void linkFirst(qsizetype idx)
+    {
+        entries[idx].prev = -1;
+        entries[idx].next = first;
+
+        if (first != -1) {
+            entries[first].prev = idx;
+        } else {
+            last = idx;
+        }
+
+        first = idx;
+    }
+
+    void unlink(qsizetype idx)
+    {
+        auto &e = entries[idx];
+
+        (e.prev != -1 ? entries[e.prev].next : first) = e.next;
+        (e.next != -1 ? entries[e.next].prev : last) = e.prev;
+
+        e.prev = -1;
+        e.next = -1;
+    }
+
+public:
+    QMutex mutex;
+    //! Prefetch put a frame to the cache.
+    QWaitCondition loaded;
+    //! Prefetch finished.
+    QWaitCondition prefetched;
+    std::vector<Entry> entries;
+    //! The most and the least recently used frames.
+    qsizetype first = -1;
+    qsizetype last = -1;
+    qint64 budget = 0;
+    int prefetchCount = 0;
+    bool prefetching = false;
+    FrameCacheStatistics stats;
+}; // struct FrameCache
+
+//
+// Gif
+//
+
+Gif::Gif(const QString &tmpPath,
+         QObject *parent)
+    : Gif(FrameStorage::Disk, tmpPath, parent)
+{
+}
+
+Gif::Gif(FrameStorage storage,
+         const QString &tmpPath,
+         QObject *parent)
+    : QObject(parent)
+    , m_tmpPath(tmpPath)
+    , m_storage(storage)
+    , m_cache(std::make_unique<FrameCache>())
+{
+    if (m_storage == FrameStorage::Disk) {
+        m_dir = std::make_unique<QTemporaryDir>(m_tmpPath);
+    }
+}
+
+Gif::~Gif()
+{
+    // Prefetch uses frames.
+    m_cache->clear();
+}
+
+FrameStorage Gif::frameStorage() const
+{
+    return m_storage;
+}
+
+int Gif::keyframeInterval() const
+{
+    return m_keyframeInterval;
+}
+
+void Gif::setKeyframeInterval(int frames)
+{
+    m_keyframeInterval = qMax(frames, 1);
+}
+
+qint64 Gif::frameCacheSize() const
+{
+    QMutexLocker lock(&m_cache->mutex);
+
+    return m_cache->budget;
+}
+
+void Gif::setFrameCacheSize(qint64 bytes)
+{
+    m_cache->setBudget(bytes);
+}
+
+int Gif::prefetchCount() const
+{
+    QMutexLocker lock(&m_cache->mutex);
+
+    return m_cache->prefetchCount;
+}
+
+void Gif::setPrefetchCount(int frames)
+{
+    QMutexLocker lock(&m_cache->mutex);
+
+    m_cache->prefetchCount = qMax(frames, 0);
+}
+
+FrameCacheStatistics Gif::frameCacheStatistics() const
+{
+    QMutexLocker lock(&m_cache->mutex);
+
+    return m_cache->stats;
+}
+
+bool Gif::closeHandle(GifFileType *handle)
+{
+    if (!DGifCloseFile(handle, nullptr)) {
+        clean();
+
+        return false;
+    } else {
+        return true;
+    }
+}
+
+bool Gif::closeHandleWithError(GifFileType *handle)
+{
+    closeHandle(handle);
+
+    clean();
+
+    return false;
+}
+
+bool Gif::closeEHandle(GifFileType *handle)
+{
+    if (!EGifCloseFile(handle, nullptr)) {
+        return false;
+    } else {
+        return true;
+    }
+}
+
+bool Gif::closeEHandleWithError(GifFileType *handle)
+{
+    closeEHandle(handle);
+
+    return false;
+}
+
+QStringList Gif::fileNames() const
+{
+    QStringList res;
+
+    if (m_dir) {
+        for (int i = 1; i <= count(); ++i) {
+            res.push_back(m_dir->filePath(QString("%1.png").arg(i)));
+        }
+    }
+
+    return res;
+}
+
+bool Gif::load(const QString &fileName)
+{
+    clean();
+
+    m_loadedKeyframeInterval = m_keyframeInterval;
+    m_fileName = fileName;
+
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    auto handle = DGifOpen(&file, readFile, nullptr);
+
+    if (handle) {
+        Extensions ext;
+        GifRecordType recordType;
+        QImage key;
+
+        do {
+            if (DGifGetRecordType(handle, &recordType) == GIF_ERROR) {
+                return closeHandleWithError(handle);
+            }
+
+            switch (recordType) {
+            case IMAGE_DESC_RECORD_TYPE: {
+                // Descriptor of the image follows the separator.
+                const qint64 offset = file.pos();
+
+                if (DGifGetImageDesc(handle) == GIF_ERROR || !isValidImage(handle)) {
+                    return closeHandleWithError(handle);
+                }
+
+                ++m_framesCount;
+
+                const QPoint pos(handle->Image.Left, handle->Image.Top);
+
+                m_delays.push_back(ext.delay);
+
+                if (m_storage == FrameStorage::Lazy) {
+                    if (!skipImage(handle)) {
+                        return closeHandleWithError(handle);
+                    }
+
+                    m_indexedFrames.push_back({QImage(), pos, ext.disposal, offset, ext.transparent});
+
+                    break;
+                }
+
+                QImage img;
+
+                if (!readImage(handle, ext.transparent, img)) {
+                    return closeHandleWithError(handle);
+                }
+
+                const QImage frame = composeFrame(key, img, pos, ext.disposal);
+
+                switch (m_storage) {
+                case FrameStorage::Memory:
+                    m_frames.push_back(frame);
+                    break;
+
+                case FrameStorage::Indexed:
+                    if ((m_framesCount - 1) % m_loadedKeyframeInterval == 0) {
+                        m_keyframes.push_back({frame, key});
+                    }
+
+                    m_indexedFrames.push_back({img, pos, ext.disposal, offset, ext.transparent});
+                    break;
+
+                default:
+                    if (m_dir->isValid()) {
+                        frame.save(m_dir->filePath(QString("%1.png").arg(m_framesCount)));
+                    }
+                    break;
+                }
+            } break;
+
+            case EXTENSION_RECORD_TYPE: {
+                if (!readExtension(handle, ext)) {
+                    return closeHandleWithError(handle);
+                }
+            } break;
+
+            case TERMINATE_RECORD_TYPE:
+                break;
+
+            default:
+                break;
+            }
+        } while (recordType != TERMINATE_RECORD_TYPE);
+
+        m_loopCount = ext.loopCount;
+
+        return closeHandle(handle);
+    } else {
+        return false;
+    }
+}
+
+bool Gif::probe(const QString &fileName,
+                GifInfo &info)
+{
+    info = {};
+
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    auto handle = DGifOpen(&file, readFile, nullptr);
+
+    if (!handle) {
+        return false;
+    }
+
+    info.size = QSize(handle->SWidth, handle->SHeight);
+
+    Extensions ext;
+    GifRecordType recordType;
+    bool ok = true;
+
+    do {
+        if (DGifGetRecordType(handle, &recordType) == GIF_ERROR) {
+            ok = false;
+            break;
+        }
+
+        if (recordType == IMAGE_DESC_RECORD_TYPE) {
+            if (DGifGetImageDesc(handle) == GIF_ERROR || !isValidImage(handle) || !skipImage(handle)) {
+                ok = false;
+                break;
+            }
+
+            ++info.count;
+            info.delays.push_back(ext.delay);
+            info.duration += qMax(ext.delay, 0);
+        } else if (recordType == EXTENSION_RECORD_TYPE && !readExtension(handle, ext)) {
+            ok = false;
+            break;
+        }
+    } while (recordType != TERMINATE_RECORD_TYPE);
+
+    info.loopCount = ext.loopCount;
+
+    if (DGifCloseFile(handle, nullptr) == GIF_ERROR) {
+        ok = false;
+    }
+
+    if (!ok) {
+        info = {};
+    }
+
+    return ok;
+}
+
+qsizetype Gif::count() const
+{
+    return m_framesCount;
+}
+
+int Gif::loopCount() const
+{
+    return m_loopCount;
+}
+
+int Gif::delay(qsizetype idx) const
+{
+    return m_delays.at(idx);
+}
+
+void Gif::setDelay(qsizetype idx, int ms)
+{
+    m_delays[idx] = ms;
+}
+
+const QVector<int> &Gif::delays() const
+{
+    return m_delays;
+}
+
+QImage Gif::at(qsizetype idx) const
+{
+    if (m_storage == FrameStorage::Memory) {
+        return m_frames.at(idx);
+    }
+
+    QImage canvas;
+
+    if (frameCacheSize() <= 0) {
+        return decodeFrame(idx, canvas);
+    }
+
+    QImage img;
+
+    if (!m_cache->find(idx, img)) {
+        img = decodeFrame(idx, canvas);
+
+        m_cache->insert(idx, img);
+    }
+
+    prefetch(idx, canvas);
+
+    return img;
+}
+
+QImage Gif::decodeFrame(qsizetype idx,
+                        QImage &canvas) const
+{
+    if (m_storage == FrameStorage::Memory) {
+        return m_frames.at(idx);
+    } else if (m_storage == FrameStorage::Lazy) {
+        return decodeLazyFrame(idx, canvas);
+    } else if (m_storage == FrameStorage::Indexed) {
+        const auto &f = m_indexedFrames.at(idx);
+
+        // The next frame of sequential decoding.
+        if (!canvas.isNull() && idx % m_loadedKeyframeInterval != 0) {
+            return composeFrame(canvas, f.image, f.pos, f.disposal);
+        }
+
+        const auto &keyframe = m_keyframes.at(idx / m_loadedKeyframeInterval);
+        QImage frame = keyframe.frame;
+        canvas = keyframe.canvas;
+
+        for (qsizetype i = idx - idx % m_loadedKeyframeInterval + 1; i <= idx; ++i) {
+            const auto &f = m_indexedFrames.at(i);
+
+            frame = composeFrame(canvas, f.image, f.pos, f.disposal);
+        }
+
+        return frame;
+    } else if (m_dir->isValid()) {
+        return QImage(m_dir->filePath(QString("%1.png").arg(idx + 1)));
+    } else {
+        return {};
+    }
+}
+
+QImage Gif::decodeLazyFrame(qsizetype idx,
+                            QImage &canvas) const
+{
+    QFile file(m_fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+
+    auto handle = DGifOpen(&file, readFile, nullptr);
+
+    if (!handle) {
+        return {};
+    }
+
+    const qsizetype interval = m_loadedKeyframeInterval;
+    qsizetype first = idx;
+    QImage frame;
+
+    // Start from the nearest cached keyframe, or from the first frame.
+    if (canvas.isNull()) {
+        first = 0;
+
+        for (qsizetype k = idx - idx % interval; k >= 0; k -= interval) {
+            if (m_cache->findKeyframe(k, frame, canvas)) {
+                first = k + 1;
+
+                break;
+            }
+        }
+    }
+
+    for (qsizetype i = first; i <= idx; ++i) {
+        const auto &f = m_indexedFrames.at(i);
+        QImage img;
+
+        if (!file.seek(f.offset) || DGifGetImageDesc(handle) == GIF_ERROR || !isValidImage(handle)
+            || !readImage(handle, f.transparent, img)) {
+            frame = QImage();
+            canvas = QImage();
+
+            break;
+        }
+
+        frame = composeFrame(canvas, img, f.pos, f.disposal);
+
+        if (i % interval == 0) {
+            m_cache->insertKeyframe(i, frame, canvas);
+        }
+    }
+
+    DGifCloseFile(handle, nullptr);
+
+    return frame;
+}
+
+void Gif::prefetch(qsizetype idx,
+                   const QImage &canvas) const
+{
+    if (count() < 2 || !m_cache->beginPrefetch()) {
+        return;
+    }
+
+    const qsizetype frames = qMin(static_cast<qsizetype>(prefetchCount()), count() - 1);
+
+    QThreadPool::globalInstance()->start([this, idx, frames, screen = canvas]() mutable {
+        for (qsizetype i = 1; i <= frames; ++i) {
+            const qsizetype next = (idx + i) % count();
+
+            // Decoding starts from the first frame again.
+            if (next == 0) {
+                screen = QImage();
+            }
+
+            // Sequential decoding is broken by the cached frame.
+            if (!m_cache->beginLoad(next)) {
+                screen = QImage();
+
+                continue;
+            }
+
+            m_cache->endLoad(next, decodeFrame(next, screen));
+        }
+
+        m_cache->endPrefetch();
+    });
+}
+
+namespace
+{
+
+//! Pixels and color map of the frame, buffers belong to the context.
+struct Resources {
+    explicit Resources(QuantizerContextData &context)
+        : m_context(context)
+    {
+    }
+
+    QuantizerContextData &m_context;
+    //! Local color map or nullptr, then the screen color map is used.
+    ColorMapObject *m_cmap = nullptr;
+    //! Index of transparent color or -1.
+    int m_transparent = -1;
+    //! Maximum count of colors in the color map.
+    static const int s_colorMapSize = 256;
+
+    //! Map image at \a origin of the frame to the palette, there is no own color map.
+    void init(const QImage &img,
+              const QPoint &origin,
+              const Palette &palette,
+              const WriteOptions &options)
+    {
+        m_cmap = nullptr;
+        m_transparent = palette.transparent;
+
+        m_context.pixels.resize(static_cast<size_t>(img.width()) * img.height());
+
+        mapImage(quantizable(img),
+                 palette,
+                 m_context.pixels.data(),
+                 img.width(),
+                 options.quantizeOptions,
+                 m_context.mapping,
+                 origin);
+    }
+
+    //! Init color map with the given colors. Size of the color map is the smallest power of 2 that holds
+    //! the colors, giflib takes LZW code size of the frame from it.
+    void initColorMap(const QList<QRgb> &colors)
+    {
+        const int bits = colorMapBits(colors.size());
+        const int size = 1 << bits;
+
+        m_cmap = &m_context.colorMap;
+        m_cmap->ColorCount = size;
+        m_cmap->BitsPerPixel = bits;
+        m_cmap->SortFlag = false;
+        m_cmap->Colors = m_context.colors;
+
+        for (int c = 0; c < size; ++c) {
+            const QRgb color = (c < colors.size() ? colors[c] : qRgb(0, 0, 0));
+
+            m_context.colors[c].Red = qRed(color);
+            m_context.colors[c].Green = qGreen(color);
+            m_context.colors[c].Blue = qBlue(color);
+        }
+    }
+
+    //! \return Indices of pixels.
+    GifPixelType *pixels()
+    {
+        return m_context.pixels.data();
+    }
+};
+
+inline QImage loadImage(const QString &fileName)
+{
+    QImage ret(fileName);
+
+    return ret;
+}
+
+//! \return Has the image alpha channel, only the header of the file is read.
+bool hasAlphaChannel(const QString &fileName)
+{
+    return (QImage::toPixelFormat(QImageReader(fileName).imageFormat()).alphaUsage() == QPixelFormat::UsesAlpha);
+}
+
+//! Write frame with prepared pixels. Frame without color map uses the screen color map.
+bool addFrame(GifFileType *handle,
+              Resources &res,
+              const QRect &r,
+              int delay,
+              int disposal)
+{
+    GraphicsControlBlock b;
+    b.DelayTime = qRound((double) delay / 10.0);
+    b.DisposalMode = disposal;
+    b.TransparentColor = res.m_transparent;
+    b.UserInputFlag = false;
+
+    GifByteType ext[4];
+
+    const auto len = EGifGCBToExtension(&b, ext);
+
+    if (EGifPutExtension(handle, GRAPHICS_EXT_FUNC_CODE, len, ext) == GIF_ERROR) {
+        return false;
+    }
+
+    if (EGifPutImageDesc(handle, r.x(), r.y(), r.width(), r.height(), false, res.m_cmap) == GIF_ERROR) {
+        return false;
+    }
+
+    if (EGifPutLine(handle, res.pixels(), r.width() * r.height()) == GIF_ERROR) {
+        return false;
+    }
+
+    return true;
+}
+
+//! State of the writer shared between frames.
+struct WriteState {
+    //! One palette for all frames.
+    bool global = false;
+    //! Buffers of quantization.
+    QuantizerContextData &context;
+    //! Palette of the screen color map.
+    Palette &screen;
+    //! The last palette built for a local color map.
+    Palette &previous;
+    bool hasPrevious = false;
+    WriteStatistics &stats;
+};
+
+//! Prepare pixels and color map of the frame. In per-frame mode the screen palette or the palette
+//! of the previous frame is reused if it represents the frame well enough, otherwise the frame is quantized.
+//! \a origin is the position of the image in the frame.
+void prepareFrame(const QImage &img,
+                  const QPoint &origin,
+                  const WriteOptions &options,
+                  WriteState &state,
+                  Resources &res)
+{
+    ++state.stats.frames;
+
+    const QImage src = quantizable(img);
+
+    if (state.global) {
+        res.init(src, origin, state.screen, options);
+
+        return;
+    }
+
+    auto &context = state.context;
+    const auto &histogram = context.histogram;
+    collectColors(src, context.histogram, context.partial, context.tasks, options.quantizeOptions);
+
+    if (options.reusePalette) {
+        if (!state.screen.colors.isEmpty()
+            && paletteFits(histogram, state.screen, options.paletteReuseMaxError)) {
+            res.init(src, origin, state.screen, options);
+
+            ++state.stats.screenPaletteReuses;
+
+            return;
+        }
+
+        if (state.hasPrevious && paletteFits(histogram, state.previous, options.paletteReuseMaxError)) {
+            res.init(src, origin, state.previous, options);
+            res.initColorMap(state.previous.colors);
+
+            ++state.stats.previousPaletteReuses;
+
+            return;
+        }
+    }
+
+    paletteOf(histogram,
+              Resources::s_colorMapSize,
+              false,
+              options.quantizeOptions,
+              context.buckets,
+              context.paletteScratch,
+              state.previous);
+    state.hasPrevious = true;
+
+    res.init(src, origin, state.previous, options);
+    res.initColorMap(state.previous.colors);
+
+    ++state.stats.quantizedFrames;
+}
+
+//! \return Frame of the given size, smaller frame is centered on black background.
+QImage fitToSize(const QImage &frame,
+                 const QSize &size)
+{
+    if (frame.size() == size) {
+        return frame;
+    }
+
+    QImage img(size, QImage::Format_ARGB32);
+    img.fill(Qt::black);
+
+    QPainter p(&img);
+    p.drawImage(frame.width() < size.width() ? (size.width() - frame.width()) / 2 : 0,
+                frame.height() < size.height() ? (size.height() - frame.height()) / 2 : 0,
+                frame);
+
+    return img;
 }
 
-bool Gif::closeEHandleWithError(GifFileType *handle)
+//! \return Image in RGB32 or ARGB32 format.
+QImage rgb32Image(const QImage &img)
 {
-    closeEHandle(handle);
-
-    return false;
+    if (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32) {
+        return img;
+    } else {
+        return img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
 }
 
-QStringList Gif::fileNames() const
+//! \return Bounding rectangle of different pixels of images of the same size.
+QRect diffRect(const QImage &key,
+               const QImage &img)
 {
-    QStringList res;
+    const QImage before = rgb32Image(key);
+    const QImage after = rgb32Image(img);
 
-    for (int i = 1; i <= count(); ++i) {
-        res.push_back(m_dir.filePath(QString("%1.png").arg(i)));
-    }
+    const auto lineOf = [](const QImage &img, int y) {
+        return reinterpret_cast<const QRgb *>(img.constScanLine(y));
+    };
 
-    return res;
-}
+    const auto bytes = static_cast<size_t>(before.width()) * sizeof(QRgb);
 
-bool Gif::load(const QString &fileName)
-{
-    clean();
+    int top = 0;
 
-    auto handle = DGifOpenFileName(fileName.toLocal8Bit().data(), nullptr);
+    while (top < before.height() && !std::memcmp(lineOf(before, top), lineOf(after, top), bytes)) {
+        ++top;
+    }
 
-    if (handle) {
-        int animDelay = -1;
-        int disposalMode = -1;
-        int transparentIndex = -1;
-        GifRecordType recordType;
-        QImage key;
+    if (top == before.height()) {
+        return QRect(0, 0, 0, 0);
+    }
 
-        do {
-            if (DGifGetRecordType(handle, &recordType) == GIF_ERROR) {
-                return closeHandleWithError(handle);
-            }
+    int bottom = before.height() - 1;
 
-            switch (recordType) {
-            case IMAGE_DESC_RECORD_TYPE: {
-                if (DGifGetImageDesc(handle) == GIF_ERROR)
-                    return closeHandleWithError(handle);
+    while (!std::memcmp(lineOf(before, bottom), lineOf(after, bottom), bytes)) {
+        --bottom;
+    }
 
-                int topRow = handle->Image.Top;
-                int leftCol = handle->Image.Left;
-                int width = handle->Image.Width;
-                int height = handle->Image.Height;
+    int left = before.width();
+    int right = -1;
 
-                if (width <= 0
-                    || height <= 0
-                    || width > (INT_MAX / height)
-                    || leftCol + width > handle->SWidth
-                    || topRow + height > handle->SHeight) {
-                    return closeHandleWithError(handle);
-                }
+    for (int y = top; y <= bottom; ++y) {
+        const auto *b = lineOf(before, y);
+        const auto *a = lineOf(after, y);
 
-                QImage img(width, height, QImage::Format_Indexed8);
-                img.fill(handle->SBackGroundColor);
+        for (int x = 0; x < left; ++x) {
+            if (b[x] != a[x]) {
+                left = x;
 
-                if (handle->Image.Interlace) {
-                    int InterlacedOffset[] = {0, 4, 2, 1};
-                    int InterlacedJumps[] = {8, 8, 4, 2};
+                break;
+            }
+        }
 
-                    for (int i = 0; i < 4; ++i) {
-                        for (int row = topRow + InterlacedOffset[i]; row < topRow + height; row += InterlacedJumps[i]) {
-                            if (DGifGetLine(handle, img.scanLine(row), width) == GIF_ERROR) {
-                                return closeHandleWithError(handle);
-                            }
-                        }
-                    }
-                } else {
-                    for (int row = 0; row < height; ++row) {
-                        if (DGifGetLine(handle, img.scanLine(row), width) == GIF_ERROR) {
-                            return closeHandleWithError(handle);
-                        }
-                    }
-                }
+        for (int x = before.width() - 1; x > right; --x) {
+            if (b[x] != a[x]) {
+                right = x;
 
-                ++m_framesCount;
+                break;
+            }
+        }
+    }
 
-                ColorMapObject *cm = (handle->Image.ColorMap ? handle->Image.ColorMap : handle->SColorMap);
+    return QRect(left, top, right - left + 1, bottom - top + 1);
+}
 
-                if (!cm)
-                    return closeHandleWithError(handle);
+//
+// FramesHistogram
+//
 
-                img.setColorCount(cm->ColorCount);
+//! Sum of histograms of a sequence of frames of the same size. Every frame only replaces pixels of
+//! the rectangle changed since the previous frame, so its cost is proportional to the changed area,
+//! the last frame is collected completely by finish(). Pixels are sampled on the grid of collectColors().
+//! The sum is N * H(last) - sum of i * (H(i) - H(i - 1)), so frames don't need to be counted beforehand.
+class FramesHistogram final
+{
+public:
+    FramesHistogram(ColorHash<quint64> &total,
+                    QuantizerContextData &context,
+                    const QuantizeOptions &options)
+        : m_total(total)
+        , m_context(context)
+        , m_options(options)
+    {
+        m_total.reset(1 << 12);
+    }
 
-                for (int i = 0; i < cm->ColorCount; ++i) {
-                    GifColorType gifColor = cm->Colors[i];
-                    QRgb color = gifColor.Blue | (gifColor.Green << 8) | (gifColor.Red << 16);
+    //! Add frame \a img.
+    void add(const QImage &img)
+    {
+        const QImage frame = rgb32Image(img);
 
-                    if (i != transparentIndex) {
-                        color |= (0xFF << 24);
-                    }
+        if (m_frame.isNull()) {
+            m_stride = histogramStride(frame, m_options);
+        } else {
+            replace(frame, diffRect(m_frame, frame), m_count);
+        }
 
-                    img.setColor(i, color);
-                }
+        m_frame = frame;
+        ++m_count;
+    }
 
-                if (key.isNull()) {
-                    img.convertTo(QImage::Format_ARGB32);
-                    key = img;
-                } else {
-                    QImage tmp = key;
+    //! Add histogram of the last frame counted for every added frame.
+    void finish()
+    {
+        if (m_frame.isNull()) {
+            return;
+        }
 
-                    {
-                        QPainter p(&tmp);
-                        p.drawImage(leftCol, topRow, img);
-                    }
+        collectColors(m_frame, m_context.histogram, m_context.partial, m_context.tasks, m_options);
 
-                    img = tmp;
+        const auto &histogram = m_context.histogram;
 
-                    if (disposalMode != DISPOSE_PREVIOUS) {
-                        key = img;
-                    }
-                }
+        for (size_t i = 0; i < histogram.keys().size(); ++i) {
+            if (histogram.keys()[i] != ColorHistogram::s_empty) {
+                m_total.value(histogram.keys()[i]) += histogram.values()[i] * m_count;
+            }
+        }
+    }
 
-                m_delays.push_back(animDelay);
+private:
+    //! Subtract change of pixels of the current frame in the rectangle \a r to pixels of \a frame
+    //! \a weight times. Counts wrap around until finish().
+    void replace(const QImage &frame,
+                 const QRect &r,
+                 quint64 weight)
+    {
+        for (int y = r.top() + (m_stride - r.top() % m_stride) % m_stride; y <= r.bottom(); y += m_stride) {
+            const auto *before = reinterpret_cast<const QRgb *>(m_frame.constScanLine(y));
+            const auto *after = reinterpret_cast<const QRgb *>(frame.constScanLine(y));
 
-                if (m_dir.isValid()) {
-                    img.save(m_dir.filePath(QString("%1.png").arg(m_framesCount)));
-                }
-            } break;
+            // The same columns as sampleColors() takes.
+            const int column = static_cast<int>(((static_cast<quint32>(y) * 2654435761u) >> 16) % m_stride);
 
-            case EXTENSION_RECORD_TYPE: {
-                GifByteType *extData;
-                int extFunction;
+            for (int x = r.left() + (column - r.left() % m_stride + m_stride) % m_stride; x <= r.right();
+                 x += m_stride) {
+                const quint32 from = keyOf<true>(before[x]);
+                const quint32 to = keyOf<true>(after[x]);
 
-                if (DGifGetExtension(handle, &extFunction, &extData) == GIF_ERROR) {
-                    return closeHandleWithError(handle);
+                if (from != to) {
+                    m_total.value(from) += weight;
+                    m_total.value(to) -= weight;
                 }
+            }
+        }
+    }
 
-                while (extData != NULL) {
-                    switch (extFunction) {
-                    case GRAPHICS_EXT_FUNC_CODE: {
-                        GraphicsControlBlock b;
-                        DGifExtensionToGCB(extData[0], extData + 1, &b);
-                        animDelay = b.DelayTime * 10;
-                        disposalMode = b.DisposalMode;
-                        transparentIndex = b.TransparentColor;
-                    } break;
-
-                    default:
-                        break;
-                    }
+private:
+    ColorHash<quint64> &m_total;
+    QuantizerContextData &m_context;
+    const QuantizeOptions &m_options;
+    //! The current frame.
+    QImage m_frame;
+    //! Count of added frames.
+    quint64 m_count = 0;
+    int m_stride = 1;
+}; // class FramesHistogram
+
+//! Build one palette for all frames. \return false if cancelled.
+bool globalPalette(const QImage &first,
+                   const QStringList &fileNames,
+                   const WriteOptions &options,
+                   QPromise<bool> *promise,
+                   QuantizerContextData &context,
+                   Palette &palette)
+{
+    const qsizetype step = qMax(options.globalPaletteFrameStep, 1);
 
-                    if (DGifGetExtensionNext(handle, &extData) == GIF_ERROR) {
-                        return closeHandleWithError(handle);
-                    }
-                }
-            } break;
+    // Counts may not fit 32 bits on long animations.
+    FramesHistogram histogram(context.total, context, options.quantizeOptions);
+    // Frames between sampled ones may have transparent pixels too, their formats are read from headers.
+    bool alpha = false;
 
-            case TERMINATE_RECORD_TYPE:
-                break;
+    for (qsizetype i = 0; i < fileNames.size(); ++i) {
+        if (promise && promise->isCanceled()) {
+            return false;
+        }
 
-            default:
-                break;
+        if (i % step) {
+            if (!alpha) {
+                alpha = hasAlphaChannel(fileNames.at(i));
             }
-        } while (recordType != TERMINATE_RECORD_TYPE);
 
-        return closeHandle(handle);
-    } else {
-        return false;
+            continue;
+        }
+
+        const QImage img = (i == 0 ? first : loadImage(fileNames.at(i)));
+
+        // Frames that can't be loaded don't contribute to the palette.
+        if (img.isNull()) {
+            continue;
+        }
+
+        histogram.add(fitToSize(img, first.size()));
     }
-}
 
-qsizetype Gif::count() const
-{
-    return m_framesCount;
-}
+    histogram.finish();
 
-int Gif::delay(qsizetype idx) const
-{
-    return m_delays.at(idx);
-}
+    const bool transparent = bucketsOf(context.total, context.buckets) || alpha || options.transparentUnchangedPixels;
 
-void Gif::setDelay(qsizetype idx, int ms)
-{
-    m_delays[idx] = ms;
-}
+    makePalette(context.buckets,
+                Resources::s_colorMapSize,
+                transparent,
+                options.quantizeOptions,
+                context.paletteScratch,
+                palette);
 
-const QVector<int> &Gif::delays() const
-{
-    return m_delays;
+    return true;
 }
 
-QImage Gif::at(qsizetype idx) const
+//! \return Image where all fully transparent pixels are 0, so they are equal on comparison.
+//! ARGB32 image is written to memory of \a spare if it's ARGB32 image of the same size.
+QImage normalized(const QImage &img,
+                  QImage &spare)
 {
-    if (m_dir.isValid()) {
-        return QImage(m_dir.filePath(QString("%1.png").arg(idx + 1)));
-    } else {
-        return {};
+    if (!img.hasAlphaChannel()) {
+        return img;
     }
-}
 
-namespace
-{
-
-template<typename T>
-struct ArrayDeleter {
-    void operator()(T *p)
-    {
-        delete[] p;
+    if (img.format() != QImage::Format_ARGB32) {
+        return normalized(img.convertToFormat(QImage::Format_ARGB32), spare);
     }
-};
 
-struct Resources {
-    std::shared_ptr<ColorMapObject> m_cmap;
-    std::shared_ptr<GifColorType> m_colors;
-    std::shared_ptr<GifPixelType> m_pixels;
-    static const int s_colorMapSize = 256;
+    QImage res;
+    std::swap(res, spare);
 
-    void init(const QImage &img)
-    {
-        const auto q = quantizeImageToKColors(img, s_colorMapSize);
+    if (res.size() != img.size() || res.format() != QImage::Format_ARGB32) {
+        res = QImage(img.size(), QImage::Format_ARGB32);
+    }
 
-        m_cmap = std::make_shared<ColorMapObject>();
-        m_cmap->ColorCount = s_colorMapSize;
-        m_cmap->BitsPerPixel = 8;
+    for (int y = 0; y < res.height(); ++y) {
+        const auto *line = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+        auto *out = reinterpret_cast<QRgb *>(res.scanLine(y));
+
+        for (int x = 0; x < res.width(); ++x) {
+            out[x] = (qAlpha(line[x]) == 0 ? 0 : line[x]);
+        }
+    }
 
-        m_colors = std::shared_ptr<GifColorType>(new GifColorType[s_colorMapSize], ArrayDeleter<GifColorType>());
+    return res;
+}
 
-        m_cmap->Colors = m_colors.get();
+//! \return Bounding rectangle of pixels that are opaque in \a current and transparent in \a next.
+QRect transparentRect(const QImage &current,
+                      const QImage &next)
+{
+    if (!next.hasAlphaChannel()) {
+        return QRect();
+    }
 
-        std::map<QRgb, unsigned char> ccm;
+    const QImage before = rgb32Image(current);
+    const QImage after = rgb32Image(next);
 
-        const auto ct = q.colorTable();
+    int left = after.width();
+    int right = -1;
+    int top = -1;
+    int bottom = -1;
 
-        for (int c = 0; c < s_colorMapSize; ++c) {
-            m_colors.get()[c].Red = qRed(ct[c]);
-            m_colors.get()[c].Green = qGreen(ct[c]);
-            m_colors.get()[c].Blue = qBlue(ct[c]);
+    for (int y = 0; y < after.height(); ++y) {
+        const auto *b = reinterpret_cast<const QRgb *>(before.constScanLine(y));
+        const auto *a = reinterpret_cast<const QRgb *>(after.constScanLine(y));
 
-            ccm[ct[c]] = static_cast<unsigned char>(c);
-        }
+        for (int x = 0; x < after.width(); ++x) {
+            if (qAlpha(a[x]) == 0 && qAlpha(b[x]) != 0) {
+                left = qMin(left, x);
+                right = qMax(right, x);
 
-        m_pixels =
-            std::shared_ptr<GifPixelType>(new GifPixelType[img.width() * img.height()], ArrayDeleter<GifPixelType>());
+                if (top < 0) {
+                    top = y;
+                }
 
-        for (int y = 0; y < img.height(); ++y) {
-            for (int x = 0; x < img.width(); ++x) {
-                m_pixels.get()[img.width() * y + x] = static_cast<unsigned char>(q.pixelIndex(x, y));
+                bottom = y;
             }
         }
     }
-};
-
-inline QImage loadImage(const QString &fileName)
-{
-    QImage ret(fileName);
 
-    return ret;
+    return (top < 0 ? QRect() : QRect(left, top, right - left + 1, bottom - top + 1));
 }
 
-bool addFrame(GifFileType *handle,
-              const QImage &img,
-              const QRect &r,
-              int delay,
-              std::vector<Resources> &resources)
+//! \return Rectangle \a r of \a img, its pixels equal to pixels of \a before are made transparent
+//! unless \a before is null. 32-bit and Indexed8 images are copied to \a buffer, it only grows,
+//! so memory is reused between frames. The returned image refers to \a buffer.
+QImage regionOf(const QImage &img,
+                const QRect &r,
+                const QImage &before,
+                std::vector<QRgb> &buffer)
 {
-    GraphicsControlBlock b;
-    b.DelayTime = qRound((double) delay / 10.0);
-    b.DisposalMode = DISPOSE_DO_NOT;
-    b.TransparentColor = -1;
-    b.UserInputFlag = false;
+    const bool rgb32 = (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32);
 
-    GifByteType ext[4];
+    if (!rgb32 && !before.isNull()) {
+        return regionOf(img.convertToFormat(QImage::Format_ARGB32), r, before, buffer);
+    }
 
-    const auto len = EGifGCBToExtension(&b, ext);
+    if (!rgb32 && img.format() != QImage::Format_Indexed8) {
+        return img.copy(r);
+    }
 
-    if (EGifPutExtension(handle, GRAPHICS_EXT_FUNC_CODE, len, ext) == GIF_ERROR) {
-        return false;
+    const int bytes = img.depth() / 8;
+    const qsizetype bytesPerLine = (static_cast<qsizetype>(r.width()) * bytes + 3) / 4 * 4;
+    const size_t size = static_cast<size_t>(bytesPerLine / 4) * r.height();
+
+    if (buffer.size() < size) {
+        buffer.resize(size);
     }
 
-    Resources res;
-    res.init(img);
-    resources.push_back(res);
+    auto *data = reinterpret_cast<uchar *>(buffer.data());
+    // RGB32 pixels have opaque alpha, so they are compared as ARGB32 ones.
+    const QImage screen = (before.isNull() ? before : rgb32Image(before));
 
-    if (EGifPutImageDesc(handle, r.x(), r.y(), r.width(), r.height(), false, res.m_cmap.get()) == GIF_ERROR) {
-        return false;
+    for (int y = 0; y < r.height(); ++y) {
+        uchar *out = data + y * bytesPerLine;
+
+        std::memcpy(out, img.constScanLine(y + r.y()) + r.x() * bytes, static_cast<size_t>(r.width()) * bytes);
+
+        if (!screen.isNull()) {
+            auto *line = reinterpret_cast<QRgb *>(out);
+            const auto *b = reinterpret_cast<const QRgb *>(screen.constScanLine(y + r.y())) + r.x();
+
+            for (int x = 0; x < r.width(); ++x) {
+                if (b[x] == line[x]) {
+                    line[x] = 0;
+                }
+            }
+        }
     }
 
-    if (EGifPutLine(handle, res.m_pixels.get(), img.width() * img.height()) == GIF_ERROR) {
-        return false;
+    QImage res(data, r.width(), r.height(), bytesPerLine, (screen.isNull() ? img.format() : QImage::Format_ARGB32));
+
+    if (img.format() == QImage::Format_Indexed8) {
+        res.setColorTable(img.colorTable());
     }
 
-    return true;
+    return res;
 }
 
-std::pair<QImage,
-          QRect>
-diffImage(const QImage &key,
-          const QImage &img)
+//! Make pixels of the rectangle transparent, as disposal to background does.
+void clearRect(QImage &img,
+               const QRect &r)
 {
-    int x = 0;
-    int y = 0;
-    int width = 0;
-    int height = 0;
+    if (img.format() != QImage::Format_ARGB32) {
+        img = img.convertToFormat(QImage::Format_ARGB32);
+    }
 
-    int i = 0;
-    int j = 0;
-    bool different = false;
+    for (int y = r.top(); y <= r.bottom(); ++y) {
+        std::fill_n(reinterpret_cast<QRgb *>(img.scanLine(y)) + r.x(), r.width(), 0u);
+    }
+}
 
-    for (; i < key.width(); ++i) {
-        for (j = 0; j < key.height(); ++j) {
-            if (key.pixel(i, j) != img.pixel(i, j)) {
-                different = true;
+//! Writes frames with delay of one frame, the next frame is needed to choose disposal of the current one.
+//! Pixels that become transparent in the next frame are cleared by disposal to background.
+class FrameWriter
+{
+public:
+    FrameWriter(GifFileType *handle,
+                unsigned int loopCount,
+                const WriteOptions &options,
+                WriteState &state)
+        : m_handle(handle)
+        , m_loopCount(loopCount)
+        , m_options(options)
+        , m_state(state)
+    {
+    }
 
-                break;
-            }
-        }
+    //! Add frame, the first one defines size of the screen. \return false on error.
+    bool add(const QImage &frame,
+             int delay)
+    {
+        if (m_pending.isNull()) {
+            m_pending = normalized(frame, m_spare);
+            m_rect = m_pending.rect();
+            m_delay = delay;
 
-        if (different) {
-            break;
+            return true;
         }
-    }
 
-    if (i < key.width()) {
-        x = i;
-    } else {
-        return {{}, QRect(0, 0, 0, 0)};
-    }
+        QImage img = normalized(fitToSize(frame, m_pending.size()), m_spare);
 
-    different = false;
+        // Unchanged frame, its delay goes to the next one.
+        if (diffRect(m_pending, img).isEmpty()) {
+            m_delta += delay;
 
-    for (j = 0; j < key.height(); ++j) {
-        for (i = x; i < key.width(); ++i) {
-            if (key.pixel(i, j) != img.pixel(i, j)) {
-                different = true;
-
-                break;
+            if (img.format() == QImage::Format_ARGB32) {
+                m_spare = std::move(img);
             }
+
+            return true;
         }
 
-        if (different) {
-            break;
+        if (!flush(&img)) {
+            return false;
+        }
+
+        QRect r = diffRect(m_canvas, img);
+
+        // Disposal made the canvas equal to the frame, but the frame is needed for disposal of the next one.
+        if (r.isEmpty()) {
+            r = QRect(0, 0, 1, 1);
         }
+
+        // The canvas before the written frame isn't needed anymore.
+        m_spare = std::move(m_before);
+        m_before = m_canvas;
+        m_pending = std::move(img);
+        m_rect = r;
+        m_delay = delay + m_delta;
+        m_delta = 0;
+
+        return true;
     }
 
-    y = j;
+    //! Write the last frame. \return false on error.
+    bool finish()
+    {
+        return (m_pending.isNull() || flush(nullptr));
+    }
 
-    different = false;
+private:
+    //! Write pending frame, \a next is the following frame or nullptr.
+    bool flush(const QImage *next)
+    {
+        QRect r = m_rect;
+        int disposal = DISPOSE_DO_NOT;
 
-    for (i = key.width() - 1; i > x; --i) {
-        for (j = y + 1; j < key.height(); ++j) {
-            if (key.pixel(i, j) != img.pixel(i, j)) {
-                different = true;
+        if (next) {
+            const QRect cleared = transparentRect(m_pending, *next);
 
-                break;
+            if (!cleared.isEmpty()) {
+                r = r.united(cleared);
+                disposal = DISPOSE_BACKGROUND;
             }
         }
 
-        if (different) {
-            break;
-        }
-    }
-
-    width = i - x + 1;
+        // Fixed palette of 256 colors doesn't have transparent color to mask unchanged pixels.
+        const bool mask = (m_options.transparentUnchangedPixels
+                           && (!m_state.global || m_state.screen.transparent >= 0));
+        const QImage img = regionOf(m_pending, r, (mask ? m_before : QImage()), m_region);
 
-    different = false;
+        Resources res(m_state.context);
+        prepareFrame(img, r.topLeft(), m_options, m_state, res);
 
-    for (j = key.height() - 1; j > y; --j) {
-        for (i = x; i < x + width; ++i) {
-            if (key.pixel(i, j) != img.pixel(i, j)) {
-                different = true;
+        if (!m_headerWritten && !writeHeader(res)) {
+            return false;
+        }
 
-                break;
-            }
+        if (!addFrame(m_handle, res, r, m_delay, disposal)) {
+            return false;
         }
 
-        if (different) {
-            break;
+        m_canvas = m_pending;
+
+        if (disposal == DISPOSE_BACKGROUND) {
+            clearRect(m_canvas, r);
         }
-    }
 
-    height = j - y + 1;
+        m_pending = QImage();
 
-    const auto r = QRect(x, y, width, height);
+        return true;
+    }
 
-    return {img.copy(r), r};
-}
+    //! Write screen descriptor and loop count. Palette of the first frame or the global one
+    //! is the screen color map, the first frame doesn't have own color map.
+    bool writeHeader(Resources &res)
+    {
+        m_headerWritten = true;
 
-std::pair<bool,
-          int>
-addFrame(GifFileType *handle,
-         QImage &key,
-         const QImage &frame,
-         int delay,
-         std::vector<Resources> &resources)
-{
-    QImage img = frame;
+        if (m_state.global) {
+            res.initColorMap(m_state.screen.colors);
+        } else {
+            std::swap(m_state.screen, m_state.previous);
+            m_state.hasPrevious = false;
+        }
 
-    if (key.width() != img.width() || key.height() != img.height()) {
-        img = QImage(key.width(), key.height(), QImage::Format_ARGB32);
-        img.fill(Qt::black);
+        if (EGifPutScreenDesc(m_handle,
+                              m_pending.width(),
+                              m_pending.height(),
+                              8,
+                              0,
+                              res.m_cmap)
+            == GIF_ERROR) {
+            return false;
+        }
 
-        QPainter p(&img);
-        p.drawImage(frame.width() < key.width() ? (key.width() - frame.width()) / 2 : 0,
-                    frame.height() < key.height() ? (key.height() - frame.height()) / 2 : 0,
-                    frame);
-    }
+        // giflib keeps a copy of the screen color map.
+        res.m_cmap = nullptr;
 
-    QImage tmp;
-    QRect r;
+        unsigned char params[3] = {1, 0, 0};
+        params[1] = (m_loopCount & 0xFF);
+        params[2] = (m_loopCount >> 8) & 0xFF;
 
-    std::tie(tmp, r) = diffImage(key, img);
+        if (EGifPutExtensionLeader(m_handle, APPLICATION_EXT_FUNC_CODE) == GIF_ERROR) {
+            return false;
+        }
 
-    bool ret = true;
-    int delta = delay;
+        if (EGifPutExtensionBlock(m_handle, 11, (GifByteType *)"NETSCAPE2.0") == GIF_ERROR) {
+            return false;
+        }
 
-    if (r.width() && r.height()) {
-        ret = addFrame(handle, tmp, r, delay, resources);
+        if (EGifPutExtensionBlock(m_handle, sizeof(params), params) == GIF_ERROR) {
+            return false;
+        }
 
-        delta = 0;
+        if (EGifPutExtensionTrailer(m_handle) == GIF_ERROR) {
+            return false;
+        }
 
-        key = img;
+        return true;
     }
 
-    return std::make_pair(ret, delta);
-}
+private:
+    GifFileType *m_handle;
+    unsigned int m_loopCount;
+    const WriteOptions &m_options;
+    WriteState &m_state;
+    //! Canvas before the pending frame.
+    QImage m_before;
+    //! Pending frame, it's the canvas after the frame before disposal.
+    QImage m_pending;
+    //! Rectangle of the pending frame.
+    QRect m_rect;
+    //! Delay of the pending frame.
+    int m_delay = 0;
+    //! Delay of skipped unchanged frames.
+    int m_delta = 0;
+    //! Canvas after the written frame and its disposal.
+    QImage m_canvas;
+    //! Image that isn't used anymore, its memory is reused by normalized().
+    QImage m_spare;
+    //! Memory of the written rectangle of the frame.
+    std::vector<QRgb> m_region;
+    bool m_headerWritten = false;
+}; // class FrameWriter
 
 } /* namespace */
 
@@ -770,7 +5024,19 @@ bool Gif::write(const QString &fileName,
                 unsigned int loopCount,
                 QPromise<bool> *promise)
 {
-    if (!pngFileNames.isEmpty() && pngFileNames.size() == delays.size()) {
+    return write(fileName, pngFileNames, delays, loopCount, WriteOptions(), promise);
+}
+
+bool Gif::write(const QString &fileName,
+                const QStringList &pngFileNames,
+                const QVector<int> &delays,
+                unsigned int loopCount,
+                const WriteOptions &options,
+                QPromise<bool> *promise)
+{
+    if (options.paletteMode == PaletteMode::Fixed && options.palette.isEmpty()) {
+        qDebug() << "Fixed palette is empty.";
+    } else if (!pngFileNames.isEmpty() && pngFileNames.size() == delays.size()) {
         auto handle = EGifOpenFileName(fileName.toLocal8Bit().data(), false, nullptr);
 
         if (handle) {
@@ -780,42 +5046,46 @@ bool Gif::write(const QString &fileName,
 
             QImage key = loadImage(pngFileNames.front());
 
-            Resources res;
-            res.init(key);
+            m_writeStatistics = {};
 
-            std::vector<Resources> resources;
+            auto &context = m_quantizerContext.data();
+            // Palettes of the previous write are not reused.
+            context.screen.colors.clear();
 
-            if (EGifPutScreenDesc(handle, key.width(), key.height(), res.s_colorMapSize, 0, res.m_cmap.get())
-                == GIF_ERROR) {
-                return closeEHandleWithError(handle);
-            }
+            WriteState state = {options.paletteMode != PaletteMode::PerFrame,
+                                context,
+                                context.screen,
+                                context.previous,
+                                false,
+                                m_writeStatistics};
 
-            unsigned char params[3] = {1, 0, 0};
-            params[1] = (loopCount & 0xFF);
-            params[2] = (loopCount >> 8) & 0xFF;
+            if (options.paletteMode == PaletteMode::Fixed) {
+                // Any frame may have transparent pixels, formats of the rest frames are read from headers.
+                bool transparent = (key.hasAlphaChannel() || options.transparentUnchangedPixels);
 
-            if (EGifPutExtensionLeader(handle, APPLICATION_EXT_FUNC_CODE) == GIF_ERROR) {
-                return closeEHandleWithError(handle);
-            }
+                for (qsizetype i = 1; i < pngFileNames.size() && !transparent; ++i) {
+                    transparent = hasAlphaChannel(pngFileNames.at(i));
+                }
 
-            if (EGifPutExtensionBlock(handle, 11, (GifByteType *)"NETSCAPE2.0") == GIF_ERROR) {
-                return closeEHandleWithError(handle);
-            }
+                fixedPalette(options.palette, transparent, state.screen);
+            } else if (state.global) {
+                if (!globalPalette(key, pngFileNames, options, promise, context, state.screen)) {
+                    closeEHandle(handle);
 
-            if (EGifPutExtensionBlock(handle, sizeof(params), params) == GIF_ERROR) {
-                return closeEHandleWithError(handle);
-            }
+                    if (promise) {
+                        promise->addResult(false);
+                    }
 
-            if (EGifPutExtensionTrailer(handle) == GIF_ERROR) {
-                return closeEHandleWithError(handle);
+                    return false;
+                }
             }
 
-            if (!addFrame(handle, key, key.rect(), delays.at(0), resources)) {
+            FrameWriter writer(handle, loopCount, options, state);
+
+            if (!writer.add(key, delays.at(0))) {
                 return closeEHandleWithError(handle);
             }
 
-            int delta = 0;
-
             emit writeProgress(qRound((1.0 / pngFileNames.size()) * 100.0));
 
             for (qsizetype i = 1; i < pngFileNames.size(); ++i) {
@@ -823,10 +5093,7 @@ bool Gif::write(const QString &fileName,
                     break;
                 }
 
-                bool result = false;
-
-                std::tie(result, delta) =
-                    addFrame(handle, key, loadImage(pngFileNames.at(i)), delays.at(i) + delta, resources);
+                const bool result = writer.add(loadImage(pngFileNames.at(i)), delays.at(i));
 
                 emit writeProgress(qRound(((double)i / pngFileNames.size()) * 100.0));
 
@@ -839,6 +5106,14 @@ bool Gif::write(const QString &fileName,
                 }
             }
 
+            if (!writer.finish()) {
+                if (promise) {
+                    promise->addResult(false);
+                }
+
+                return closeEHandleWithError(handle);
+            }
+
             closeEHandle(handle);
 
             if (promise) {
@@ -864,12 +5139,31 @@ bool Gif::write(const QString &fileName,
     return false;
 }
 
+const WriteStatistics &Gif::writeStatistics() const
+{
+    return m_writeStatistics;
+}
+
+QuantizerContext &Gif::quantizerContext()
+{
+    return m_quantizerContext;
+}
+
 void Gif::clean()
 {
+    // Prefetch uses frames.
+    m_cache->clear();
     m_framesCount = 0;
+    m_loopCount = -1;
     m_delays.clear();
-    m_dir.remove();
-    m_dir = QTemporaryDir(m_tmpPath);
+    m_frames.clear();
+    m_indexedFrames.clear();
+    m_keyframes.clear();
+
+    if (m_dir) {
+        m_dir->remove();
+        m_dir = std::make_unique<QTemporaryDir>(m_tmpPath);
+    }
 }
 
 } /* namespace QGifLib */
@@ -1,4 +1,3 @@
-
 /*
     SPDX-FileCopyrightText: 2026 Igor Mironchik <igor.mironchik@gmail.com>
     SPDX-License-Identifier: MIT
@@ -16,12 +15,237 @@
 // giflib include.
 #include <gif_lib.h>
 
+// C++ include.
+#include <memory>
+
+class QThreadPool;
+
 namespace QGifLib
 {
 
-//! Quantize image to K colors.
+//! SIMD instruction set.
+enum class SimdLevel {
+    //! No SIMD, plain C++.
+    Scalar,
+    //! SSE4.1.
+    SSE41,
+    //! AVX2.
+    AVX2
+}; // enum class SimdLevel
+
+//! \return SIMD instruction set used by quantizer, it's detected at runtime.
+SimdLevel simdLevel();
+
+//! Limit SIMD instruction set used by quantizer. SimdLevel::Scalar forces plain C++ code,
+//! that is useful for verification of results.
+void setMaxSimdLevel(SimdLevel level);
+
+//! Quantization algorithm.
+enum class Quantizer {
+    //! Median cut, boxes of colors are split by the longest side.
+    MedianCut,
+    //! Xiaolin Wu's quantizer, minimizes variance of boxes in 32x32x32 colors cube.
+    //! Time is O(pixels + 32^3).
+    Wu,
+    //! Octree with bounded count of leaves.
+    Octree
+}; // enum class Quantizer
+
+//! Dithering of quantized image.
+enum class Dithering {
+    //! Every pixel gets the color of its box.
+    None,
+    //! Ordered dithering with 8x8 Bayer matrix, rows are processed in parallel.
+    Bayer,
+    //! Floyd-Steinberg error diffusion, rows are processed one by one.
+    FloydSteinberg
+}; // enum class Dithering
+
+//! Color space of quantization.
+enum class ColorSpace {
+    //! sRGB, median cut weights sides of boxes by luma.
+    RGB,
+    //! YCbCr of ITU-R BT.601.
+    YCbCr,
+    //! Oklab, distances are close to perceived differences.
+    Oklab
+}; // enum class ColorSpace
+
+//! Quantization options.
+struct QuantizeOptions {
+    //! Quantization algorithm.
+    Quantizer quantizer = Quantizer::MedianCut;
+    //! Thread pool for histogram collection and mapping of pixels. If it's nullptr
+    //! QThreadPool::globalInstance() is used.
+    QThreadPool *threadPool = nullptr;
+    //! Maximum count of threads, 1 disables multithreading, 0 means maximum of the thread pool.
+    //! Result doesn't depend on count of threads.
+    int maxThreads = 0;
+    //! Histogram is collected from every N-th pixel of every N-th row, 1 means all pixels.
+    //! 0 selects N by count of pixels, images larger than 4 megapixels are sampled down to about 1 megapixel.
+    //! All pixels are mapped to the palette anyway.
+    int histogramStride = 1;
+    //! Dithering, it's done in the pass of mapping pixels to the palette.
+    //! Images with not more colors than the palette are not dithered.
+    Dithering dithering = Dithering::None;
+    //! Maximum count of iterations of k-means refinement of the palette over colors of the histogram,
+    //! 0 disables refinement.
+    int kmeansIterations = 0;
+    //! K-means stops when no color of the palette moves farther than this distance. It's measured in
+    //! the color space of colorSpace, i.e. in 8-bit components of RGB, YCbCr or Oklab.
+    double kmeansThreshold = 1.0;
+    //! Color space where the palette is built. Colors of the histogram are converted with
+    //! integer tables, pixels are mapped to the palette in RGB.
+    ColorSpace colorSpace = ColorSpace::RGB;
+}; // struct QuantizeOptions
+
+//! Quantize image to K colors, K is limited by 256. Color table of the result has only built colors,
+//! it's shorter than K if the image has fewer colors. If the image has fully transparent pixels one of
+//! K colors is transparent, the rest are built from opaque pixels.
 QImage quantizeImageToKColors(const QImage &img,
-                              long long int k);
+                              long long int k,
+                              const QuantizeOptions &options = {});
+
+struct QuantizerContextData;
+
+//
+// QuantizerContext
+//
+
+//! Buffers of quantization and writing of GIF. They are allocated on first use, only grow and are reused
+//! by the next calls, so frames of the same size are processed without allocation of memory for histograms,
+//! palettes and pixels. Context can't be used by several threads at once.
+class QuantizerContext final
+{
+public:
+    QuantizerContext();
+    ~QuantizerContext();
+
+    //! Release memory of buffers, they are allocated again on the next use.
+    void clear();
+
+private:
+    Q_DISABLE_COPY(QuantizerContext)
+
+    //! \return Buffers, they are created on the first call.
+    QuantizerContextData &data();
+
+    friend QImage quantizeImageToKColors(const QImage &img,
+                                         long long int k,
+                                         const QuantizeOptions &options,
+                                         QuantizerContext &context);
+    friend class Gif;
+
+    std::unique_ptr<QuantizerContextData> m_data;
+}; // class QuantizerContext
+
+//! Quantize image to K colors with buffers of the context.
+QImage quantizeImageToKColors(const QImage &img,
+                              long long int k,
+                              const QuantizeOptions &options,
+                              QuantizerContext &context);
+
+//! Palette mode of GIF.
+enum class PaletteMode {
+    //! Every frame has own palette.
+    PerFrame,
+    //! One palette for all frames is stored as screen color map, frames don't have own color maps.
+    //! Colors of frames are accumulated before writing.
+    Global,
+    //! WriteOptions::palette is stored as screen color map, frames are only mapped to it.
+    //! If it has less than 256 colors and any frame has alpha channel or
+    //! WriteOptions::transparentUnchangedPixels is set, transparent color is added.
+    Fixed
+}; // enum class PaletteMode
+
+//! \return Grayscale palette of \a count colors from black to white, \a count is in [2, 256].
+QList<QRgb> grayscalePalette(int count = 256);
+
+//! \return Web-safe palette of 216 colors, 6 levels of every component.
+QList<QRgb> webSafePalette();
+
+//! Options of writing GIF.
+struct WriteOptions {
+    //! Options of quantization of frames.
+    QuantizeOptions quantizeOptions;
+    //! Palette mode.
+    PaletteMode paletteMode = PaletteMode::PerFrame;
+    //! Only every N-th frame contributes colors to the global palette, 1 means all frames. Formats of other
+    //! frames are still read, so the palette has transparent color if any frame has alpha channel.
+    int globalPaletteFrameStep = 1;
+    //! Colors of the fixed palette, first 256 colors are used.
+    QList<QRgb> palette;
+    //! In per-frame mode reuse the screen palette or the palette of the previous frame
+    //! instead of quantization of the frame if error is not greater than paletteReuseMaxError.
+    bool reusePalette = false;
+    //! Maximum mean squared distance in RGB between pixels of the frame and colors of the reused palette.
+    double paletteReuseMaxError = 4.0;
+    //! Pixels of the changed rectangle that are equal to the previous frame are written with
+    //! transparent color, long runs of them are compressed better. One palette slot is reserved for it.
+    //! Fixed palette of 256 colors has no free slot, so pixels are written as is.
+    bool transparentUnchangedPixels = false;
+}; // struct WriteOptions
+
+//! Statistics of the last writing of GIF.
+struct WriteStatistics {
+    //! Count of written frames.
+    qsizetype frames = 0;
+    //! Count of frames quantized with own palette.
+    qsizetype quantizedFrames = 0;
+    //! Count of frames that reused the screen palette, they don't have local color maps.
+    qsizetype screenPaletteReuses = 0;
+    //! Count of frames that reused the palette of the previous frame.
+    qsizetype previousPaletteReuses = 0;
+}; // struct WriteStatistics
+
+//! Storage of frames of loaded GIF.
+enum class FrameStorage {
+    //! Every frame is stored in PNG file in temporary directory, Gif::at() decodes it.
+    //! Only this storage provides Gif::fileNames().
+    Disk,
+    //! Frames are kept in memory, Gif::at() returns them without decoding and copying.
+    //! It takes width * height * 4 bytes per frame.
+    Memory,
+    //! Frames are kept in memory as indexed images of GIF with their palettes and disposals, it takes
+    //! about the size of pixels of GIF. Every Gif::keyframeInterval()-th frame is kept composed,
+    //! so Gif::at() draws not more than that count of images.
+    Indexed,
+    //! Gif::load() reads only structure of GIF and offsets of images, pixels are decoded from the file
+    //! by Gif::at(), the file must not change. Keyframes as in FrameStorage::Indexed are composed
+    //! on access and kept in the cache of frames, so access far from cached keyframes decodes all
+    //! frames before.
+    Lazy
+}; // enum class FrameStorage
+
+//! Statistics of the cache of decoded frames.
+struct FrameCacheStatistics {
+    //! Count of Gif::at() calls served from the cache.
+    qsizetype hits = 0;
+    //! Count of Gif::at() calls that decoded the frame.
+    qsizetype misses = 0;
+    //! Count of frames removed from the cache to fit the budget.
+    qsizetype evictions = 0;
+    //! Count of frames decoded by prefetch.
+    qsizetype prefetched = 0;
+    //! Size of cached frames in bytes.
+    qint64 bytes = 0;
+}; // struct FrameCacheStatistics
+
+//! Metadata of GIF read by Gif::probe().
+struct GifInfo {
+    //! Count of frames.
+    qsizetype count = 0;
+    //! Size of the screen.
+    QSize size;
+    //! Delays of frames in milliseconds as Gif::delays() after Gif::load().
+    QVector<int> delays;
+    //! Sum of not negative delays in milliseconds.
+    qint64 duration = 0;
+    //! Animation loop count, 0 means infinite, -1 means GIF without loop extension.
+    int loopCount = -1;
+}; // struct GifInfo
+
+struct FrameCache;
 
 //
 // Gif
@@ -39,12 +263,44 @@ signals:
 public:
     Gif(const QString &tmpPath = QStringLiteral("./"),
         QObject *parent = nullptr);
-    ~Gif() = default;
+    //! Temporary directory is created only for FrameStorage::Disk.
+    explicit Gif(FrameStorage storage,
+                 const QString &tmpPath = QStringLiteral("./"),
+                 QObject *parent = nullptr);
+    ~Gif();
+
+    //! \return Storage of frames.
+    FrameStorage frameStorage() const;
+    //! \return Interval of composed frames of FrameStorage::Indexed.
+    int keyframeInterval() const;
+    //! Set interval of composed frames of FrameStorage::Indexed, it's applied on the next load. Default is 16.
+    void setKeyframeInterval(int frames);
+
+    //! \return Budget of the cache of decoded frames in bytes.
+    qint64 frameCacheSize() const;
+    //! Set budget of the LRU cache of frames decoded by at(), 0 disables the cache. It's used
+    //! with FrameStorage::Disk, FrameStorage::Indexed and FrameStorage::Lazy, memory storage doesn't
+    //! decode frames. Keyframes of FrameStorage::Lazy with their canvases are cached in the same budget.
+    void setFrameCacheSize(qint64 bytes);
+    //! \return Count of prefetched frames.
+    int prefetchCount() const;
+    //! Set count of frames following the requested one that at() decodes into the cache in background.
+    //! Indices wrap around, so looping playback is prefetched too. It works only with enabled cache.
+    void setPrefetchCount(int frames);
+    //! \return Statistics of the cache of decoded frames since the last load.
+    FrameCacheStatistics frameCacheStatistics() const;
 
     //! Load GIF.
     bool load(
         //! Input file name.
         const QString &fileName);
+    //! Read metadata of GIF without decoding of frames, LZW data is skipped.
+    //! \return false on error, \a info is empty then.
+    static bool probe(
+        //! Input file name.
+        const QString &fileName,
+        //! Metadata.
+        GifInfo &info);
     //! \return Delay interval in millseconds. First delay with index 0 is a delay between frames with indexes 0 and 1.
     int delay(qsizetype idx) const;
     //! Set delay.
@@ -53,12 +309,14 @@ public:
     const QVector<int> &delays() const;
     //! \return Count of frames.
     qsizetype count() const;
+    //! \return Animation loop count of NETSCAPE2.0 extension, 0 means infinite, -1 means GIF without it.
+    int loopCount() const;
     //! \return Frame with given index (starting at 0).
     QImage at(
         //! Index of the requested frame (indexing starts with 0).
         qsizetype idx) const;
 
-    //! \return File names of frames.
+    //! \return File names of frames, it's empty if frames are not stored on disk.
     QStringList fileNames() const;
 
     //! Write GIF from sequence of PNG files.
@@ -73,6 +331,24 @@ public:
         unsigned int loopCount,
         //! QPromise for cancelling write operation in multithreaded environment.
         QPromise<bool> *promise = nullptr);
+    //! Write GIF from sequence of PNG files with the given options.
+    bool write(
+        //! Output file name.
+        const QString &fileName,
+        //! Sequence of PNG file names.
+        const QStringList &pngFileNames,
+        //! Sequence of delays in milliseconds.
+        const QVector<int> &delays,
+        //! Animation loop count, 0 means infinite.
+        unsigned int loopCount,
+        //! Options.
+        const WriteOptions &options,
+        //! QPromise for cancelling write operation in multithreaded environment.
+        QPromise<bool> *promise = nullptr);
+    //! \return Statistics of the last write.
+    const WriteStatistics &writeStatistics() const;
+    //! \return Buffers of writing, they are kept between writes. Call QuantizerContext::clear() to release memory.
+    QuantizerContext &quantizerContext();
 
     //! Clean internals.
     void clean();
@@ -81,14 +357,61 @@ private:
     bool closeHandleWithError(GifFileType *handle);
     bool closeHandle(GifFileType *handle);
 
+    //! \return Decoded frame. For FrameStorage::Indexed and FrameStorage::Lazy not null \a canvas is
+    //! the screen after the previous frame, it becomes the screen after this frame.
+    QImage decodeFrame(qsizetype idx,
+                       QImage &canvas) const;
+    //! \return Frame of FrameStorage::Lazy decoded from the file.
+    QImage decodeLazyFrame(qsizetype idx,
+                           QImage &canvas) const;
+    //! Decode frames following \a idx into the cache in background.
+    void prefetch(qsizetype idx,
+                  const QImage &canvas) const;
+
     static bool closeEHandleWithError(GifFileType *handle);
     static bool closeEHandle(GifFileType *handle);
 
 private:
     QString m_tmpPath;
+    //! Loaded file.
+    QString m_fileName;
+    FrameStorage m_storage = FrameStorage::Disk;
     qsizetype m_framesCount = 0;
-    QTemporaryDir m_dir;
+    int m_loopCount = -1;
+    //! Directory of FrameStorage::Disk.
+    std::unique_ptr<QTemporaryDir> m_dir;
+    //! Frames of FrameStorage::Memory.
+    QVector<QImage> m_frames;
+
+    //! Frame of FrameStorage::Indexed and FrameStorage::Lazy.
+    struct IndexedFrame {
+        //! Pixels with palette of the frame, it's null in FrameStorage::Lazy.
+        QImage image;
+        //! Position on the screen.
+        QPoint pos;
+        int disposal = 0;
+        //! Offset of the image descriptor in the file.
+        qint64 offset = 0;
+        //! Transparent index.
+        int transparent = -1;
+    };
+
+    //! Composed frame of FrameStorage::Indexed.
+    struct Keyframe {
+        QImage frame;
+        //! Screen after disposal of the frame.
+        QImage canvas;
+    };
+
+    QVector<IndexedFrame> m_indexedFrames;
+    QVector<Keyframe> m_keyframes;
+    int m_keyframeInterval = 16;
+    //! Interval of loaded keyframes.
+    int m_loadedKeyframeInterval = 16;
+    std::unique_ptr<FrameCache> m_cache;
     QVector<int> m_delays;
+    WriteStatistics m_writeStatistics;
+    QuantizerContext m_quantizerContext;
 }; // class Gif
 
 } /* namespace QGifLib */